@@ -0,0 +1,286 @@
+// Allocation benchmark for book storage in server5.c: heap calls and peak RSS of ingesting many
+// books at once, against the malloc-per-node, strdup-per-line storage the arena replaced
+// Build: gcc -O2 -pthread alloc_bench.c -o alloc_bench
+// Usage: ./alloc_bench [-t threads] [-n books per thread] [file...]   (default: -t 4 -n 16 vegetarian.txt)
+
+#define main server5_main  // Reuse the server's ingestion without its main()
+#include "server5.c"
+#undef main
+
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/wait.h>
+
+#define DEFAULT_BENCH_THREADS 4   // Threads ingesting at once, like workers on separate connections
+#define DEFAULT_BENCH_BOOKS 16    // Books each thread ingests; all of them stay resident until the end
+
+// glibc's allocator, under the names the counting wrappers below forward to
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+
+// Heap calls made while counting is on; every thread counts into the same totals
+atomic_int counting;
+atomic_ulong allocations;
+
+// Count one allocation if a measurement is running
+void count_allocation(void) {
+    if (atomic_load_explicit(&counting, memory_order_relaxed)) {
+        atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    }
+}
+
+// These replace glibc's allocation entry points for the whole process, strdup and friends included
+void *malloc(size_t size) {
+    count_allocation();
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    count_allocation();
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    count_allocation();
+    return __libc_realloc(ptr, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    count_allocation();
+    return __libc_memalign(alignment, size);
+}
+
+// A line as books stored them before the arena: its own node and its own copy of the bytes
+typedef struct LegacyNode {
+    char *line;
+    struct LegacyNode *book_next;
+    struct LegacyNode *next_frequent_search;
+} LegacyNode;
+
+typedef struct LegacyBook {
+    int occurrences;
+    LegacyNode *book_head, *book_tail;
+    LegacyNode *frequent_search_head, *frequent_search_tail;
+} LegacyBook;
+
+// What one benchmark thread ingests, and the books it keeps until the end
+typedef struct BenchThread {
+    pthread_t thread;
+    int legacy;
+    int books;
+    const char *text;
+    size_t len;
+    void **kept;
+} BenchThread;
+
+int bench_threads = DEFAULT_BENCH_THREADS;
+int bench_books = DEFAULT_BENCH_BOOKS;
+
+// Wall-clock time in seconds
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Resident set size of this process in kB, now (VmRSS) or at its peak (VmHWM)
+long rss_kb(const char *field) {
+    char line[256];
+    long kb = -1;
+    FILE *file = fopen("/proc/self/status", "r");
+    if (file == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (strncmp(line, field, strlen(field)) == 0) {
+            kb = atol(line + strlen(field));
+        }
+    }
+    fclose(file);
+    return kb;
+}
+
+// Store text line by line the way add_node_to_book_list did before the arena
+LegacyBook *ingest_legacy(const char *text, size_t len) {
+    LegacyBook *book = calloc(1, sizeof(LegacyBook));
+    const char *pos = text;
+    const char *end = text + len;
+    while (pos < end) {
+        const char *newline = memchr(pos, '\n', end - pos);
+        size_t line_len = newline != NULL ? (size_t)(newline - pos) + 1 : (size_t)(end - pos);
+        LegacyNode *node = malloc(sizeof(LegacyNode));
+        if (book == NULL || node == NULL || (node->line = strndup(pos, line_len)) == NULL) {
+            error("ERROR allocating legacy node");
+        }
+        node->book_next = node->next_frequent_search = NULL;
+        if (book->book_tail == NULL) {
+            book->book_head = node;
+        } else {
+            book->book_tail->book_next = node;
+        }
+        book->book_tail = node;
+
+        int found_occurrences = 0;
+        for (const char *match = node->line; (match = strstr(match, search_terms[0])) != NULL; match++) {
+            found_occurrences++;
+        }
+        book->occurrences += found_occurrences;
+        if (found_occurrences > 0) {
+            if (book->frequent_search_tail == NULL) {
+                book->frequent_search_head = node;
+            } else {
+                book->frequent_search_tail->next_frequent_search = node;
+            }
+            book->frequent_search_tail = node;
+        }
+        pos += line_len;
+    }
+    return book;
+}
+
+void free_legacy(LegacyBook *book) {
+    LegacyNode *node = book->book_head;
+    while (node != NULL) {
+        LegacyNode *next = node->book_next;
+        free(node->line);
+        free(node);
+        node = next;
+    }
+    free(book);
+}
+
+// Upload text as one book through the server's ingestion path, a socket read's worth at a time
+Book *ingest_server(const char *text, size_t len) {
+    Connection *conn = create_connection(-1, NULL);
+    Book *book = conn->book;
+    for (size_t pos = 0; pos < len; pos += BUFFER_SIZE) {
+        size_t n = len - pos < BUFFER_SIZE ? len - pos : BUFFER_SIZE;
+        grow_text(book, n);
+        memcpy(book->text + book->text_len, text + pos, n);
+        book->text_len += n;
+        index_received_bytes(conn, 0);
+    }
+    index_received_bytes(conn, 1);
+    release_connection(conn);
+    return book;
+}
+
+void *bench_thread_func(void *arg) {
+    BenchThread *self = (BenchThread *)arg;
+    for (int i = 0; i < self->books; i++) {
+        self->kept[i] = self->legacy ? (void *)ingest_legacy(self->text, self->len) : (void *)ingest_server(self->text, self->len);
+    }
+    return NULL;
+}
+
+// Ingest every thread's books with one kind of storage and report what it cost; runs in a child
+// process of its own, so the peak RSS is this storage's alone
+void run_storage(int legacy, const char *text, size_t len) {
+    BenchThread *threads = calloc(bench_threads, sizeof(BenchThread));
+    for (int t = 0; t < bench_threads; t++) {
+        threads[t].legacy = legacy;
+        threads[t].books = bench_books;
+        threads[t].text = text;
+        threads[t].len = len;
+        threads[t].kept = calloc(bench_books, sizeof(void *));
+    }
+    long base_kb = rss_kb("VmRSS:");
+
+    atomic_store(&counting, 1);
+    double start = now_seconds();
+    for (int t = 0; t < bench_threads; t++) {
+        pthread_create(&threads[t].thread, NULL, bench_thread_func, &threads[t]);
+    }
+    for (int t = 0; t < bench_threads; t++) {
+        pthread_join(threads[t].thread, NULL);
+    }
+    double elapsed = now_seconds() - start;
+    atomic_store(&counting, 0);
+    long peak_kb = rss_kb("VmHWM:");
+
+    // Freeing is part of the cost too: one walk per book before, one arena_free per book now
+    double free_start = now_seconds();
+    for (int t = 0; t < bench_threads; t++) {
+        for (int i = 0; i < bench_books; i++) {
+            if (legacy) {
+                free_legacy(threads[t].kept[i]);
+            } else {
+                Book *book = threads[t].kept[i];
+                unregister_book(book);
+                remove_book_from_ranking(book);
+                release_book(book);
+            }
+        }
+    }
+    double free_elapsed = now_seconds() - free_start;
+
+    int books = bench_threads * bench_books;
+    unsigned long count = atomic_load(&allocations);
+    printf("  %-6s %9lu allocations (%7.1f per book)  %7.1f ms ingest %6.1f ms free  peak RSS %ld kB (+%ld kB)\n",
+           legacy ? "legacy" : "arena", count, (double)count / books, elapsed * 1e3, free_elapsed * 1e3,
+           peak_kb, peak_kb - base_kb);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "t:n:")) != -1) {
+        switch (opt) {
+        case 't':
+            bench_threads = atoi(optarg);
+            break;
+        case 'n':
+            bench_books = atoi(optarg);
+            break;
+        default:
+            bench_threads = 0;
+        }
+    }
+    if (bench_threads < 1 || bench_books < 1) {
+        fprintf(stderr, "Usage: %s [-t threads] [-n books per thread] [file...]\n", argv[0]);
+        exit(1);
+    }
+
+    log_level = LOG_WARN;
+    add_search_term("the");
+    build_automaton(&automaton, search_terms, search_term_count);
+    search_term_length = strlen(search_terms[0]);
+    count_occurrences = select_count_kernel();
+    init_registry();
+
+    const char *default_files[] = {"vegetarian.txt"};
+    const char **files = optind < argc ? (const char **)argv + optind : default_files;
+    int file_count = optind < argc ? argc - optind : 1;
+    for (int f = 0; f < file_count; f++) {
+        FILE *file = fopen(files[f], "rb");
+        if (file == NULL) {
+            error("ERROR opening file");
+        }
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        char *text = malloc(size);
+        if (text == NULL || fread(text, 1, size, file) != (size_t)size) {
+            error("ERROR reading file");
+        }
+        fclose(file);
+        printf("%s (%ld bytes): %d threads x %d books\n", files[f], size, bench_threads, bench_books);
+        fflush(stdout);
+
+        for (int legacy = 1; legacy >= 0; legacy--) {
+            pid_t pid = fork();
+            if (pid < 0) {
+                error("ERROR forking");
+            }
+            if (pid == 0) {
+                run_storage(legacy, text, size);
+                fflush(stdout);
+                _exit(0);
+            }
+            waitpid(pid, NULL, 0);
+        }
+        free(text);
+    }
+    return 0;
+}
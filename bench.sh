@@ -0,0 +1,214 @@
+#!/bin/bash
+
+# Benchmark every server variant against fixed workloads built from the bundled texts
+# Usage: ./bench.sh [-r repeats] [-o results.json] [-b baseline.json|commit] [variant...]
+#        ./bench.sh build
+# Variants: server serverPart1 shouldWork trial server5 (default: all of them)
+# Results go to bench_results/<commit>.json, one line per variant and workload, so two
+# commits can be compared with -b. So can two server5 configurations, e.g. the work-stealing pool
+# against a single worker (it only splits matching when there are several cores):
+#   SERVER5_ARGS="-t 1" ./bench.sh -o t1.json server5 && SERVER5_ARGS="-t 4" ./bench.sh -b t1.json server5
+
+REPEATS=3                  # Runs per variant and workload; the run with the median MB/s is kept
+TIMEOUT=30                 # Seconds before a run is abandoned and recorded as failed
+BASE_PORT=23400            # Each run listens on a fresh port; the old servers do not set SO_REUSEADDR
+SEARCH_TERM="the"          # For the variants that take -p
+SERVER5_ARGS=${SERVER5_ARGS:-}   # Extra server5 options, e.g. SERVER5_ARGS="-t 8 -m 1000"
+
+ALL_VARIANTS=(server serverPart1 shouldWork trial server5)
+
+# Workloads: name, uploads, concurrent connections, files (generated ones live in the work directory)
+WORKLOADS=(
+  "small 2000 32 small_*.txt"
+  "huge 4 4 huge.txt"
+  "single 3 1 huge.txt"
+  "connect 20000 64 tiny.txt"
+  "chars 1000 16 a_chars.txt b_chars.txt c_chars.txt d_chars.txt e_chars.txt f_chars.txt g_chars.txt h_chars.txt i_chars.txt j_chars.txt"
+)
+
+REPO=$(cd "$(dirname "$0")" && pwd)
+BUILD="$REPO/bench_build"
+
+# Compile the load generator and every variant
+build() {
+  mkdir -p "$BUILD" || exit 1
+  gcc -O2 -pthread "$REPO/loadgen.c" -o "$BUILD/loadgen" || exit 1
+  for variant in "${ALL_VARIANTS[@]}"; do
+    gcc -O2 -pthread -w "$REPO/$variant.c" -o "$BUILD/$variant" || exit 1
+  done
+}
+
+# Generate the workload files: ~4 KB slices of fox.txt, one 8 MB book of every novel repeated, and
+# a one-line book whose upload costs little more than the connection itself
+make_workload_files() {
+  local dir=$1
+  split -l 40 -d -a 3 --additional-suffix=.txt "$REPO/fox.txt" "$dir/small_"
+  : > "$dir/huge.txt"
+  while [ "$(stat -c %s "$dir/huge.txt")" -lt 8388608 ]; do
+    cat "$REPO"/fox.txt "$REPO"/aldyths.txt "$REPO"/vegetarian.txt "$REPO"/noplacelikehome.txt \
+        "$REPO"/thegoldgenrule.txt >> "$dir/huge.txt"
+  done
+  head -n 1 "$REPO/fox.txt" > "$dir/tiny.txt"
+  cp "$REPO"/?_chars.txt "$dir/"
+}
+
+# Wait until something listens on the port, without connecting to it (a connection would be a book)
+wait_for_listen() {
+  local hex
+  hex=$(printf ':%04X ' "$1")
+  for _ in $(seq 100); do
+    grep -q "$hex[0-9A-F:]* 0A " /proc/net/tcp && return 0
+    sleep 0.05
+  done
+  return 1
+}
+
+# Run one variant against one workload; prints "mb_per_s json_fields"
+run_once() {
+  local variant=$1 port=$2 uploads=$3 connections=$4
+  shift 4
+  local rundir pid out ticks
+  rundir=$(mktemp -d "$WORK/run.XXXXXX")
+  case $variant in
+    server|serverPart1|trial) args=("$port") ;;
+    shouldWork) args=(-l "$port" -p "$SEARCH_TERM") ;;
+    server5) args=(-l "$port" -p "$SEARCH_TERM" $SERVER5_ARGS) ;;
+  esac
+  (cd "$rundir" && exec "$BUILD/$variant" "${args[@]}" > /dev/null 2>&1) &
+  pid=$!
+  if ! wait_for_listen "$port"; then
+    kill "$pid" 2> /dev/null
+    wait "$pid" 2> /dev/null
+    echo "0 \"failed\": $uploads, \"error\": \"server did not start\""
+    return
+  fi
+
+  out=$(cd "$WORK" && timeout "$TIMEOUT" "$BUILD/loadgen" -l "$port" -c "$connections" -n "$uploads" "$@" 2>&1)
+  local status=$?
+
+  # Peak RSS and CPU time come from /proc before the server is stopped
+  local rss cpu
+  rss=$(awk '/^VmHWM:/ { print $2 }' "/proc/$pid/status" 2> /dev/null)
+  ticks=$(awk '{ print $14 + $15 }' "/proc/$pid/stat" 2> /dev/null)
+  cpu=$(awk -v t="${ticks:-0}" -v hz="$(getconf CLK_TCK)" 'BEGIN { printf "%.2f", t / hz }')
+  kill "$pid" 2> /dev/null
+  wait "$pid" 2> /dev/null
+  rm -rf "$rundir"
+
+  echo "$out" | awk -v rss="${rss:-0}" -v cpu="$cpu" -v status="$status" -v uploads="$uploads" '
+    /^uploads:/ { completed = $2; failed = $4 }
+    /^elapsed:/ { seconds = $2; cps = $4; mbps = $6 }
+    /^latency:/ { p50 = $3; p99 = $9 }
+    END {
+      if (completed == "") { completed = 0; failed = uploads }
+      if (status == 124) { failed = uploads - completed }
+      printf "%s \"completed\": %d, \"failed\": %d, \"seconds\": %.3f, \"conn_per_s\": %.1f, \"mb_per_s\": %.1f, ",
+             mbps + 0, completed, failed, seconds, cps, mbps
+      printf "\"p50_ms\": %.2f, \"p99_ms\": %.2f, \"peak_rss_kb\": %d, \"cpu_s\": %s", p50, p99, rss, cpu
+      if (status == 124) {
+        printf ", \"error\": \"timeout\""
+      } else if (rss == 0) {
+        printf ", \"error\": \"server exited\""
+      }
+      printf "\n"
+    }'
+}
+
+# Print the change of every metric against a baseline result file
+compare() {
+  local baseline=$1 results=$2
+  awk '
+    function field(line, name,    m) {
+      if (match(line, "\"" name "\": \"?[^,\"}]*")) {
+        m = substr(line, RSTART, RLENGTH)
+        sub(/^"[^"]*": "?/, "", m)
+        return m
+      }
+      return ""
+    }
+    function delta(new, old) {
+      return old > 0 ? sprintf("%+.1f%%", (new - old) / old * 100) : "n/a"
+    }
+    /"variant"/ {
+      key = field($0, "variant") "/" field($0, "workload")
+      if (FILENAME == ARGV[1]) {
+        base[key] = $0
+        next
+      }
+      if (!(key in base)) {
+        printf "%-22s (no baseline)\n", key
+        next
+      }
+      b = base[key]
+      printf "%-22s MB/s %8s  p99 %8s  RSS %8s  CPU %8s\n", key,
+             delta(field($0, "mb_per_s"), field(b, "mb_per_s")), delta(field($0, "p99_ms"), field(b, "p99_ms")),
+             delta(field($0, "peak_rss_kb"), field(b, "peak_rss_kb")), delta(field($0, "cpu_s"), field(b, "cpu_s"))
+    }' "$baseline" "$results"
+}
+
+if [ "$1" = "build" ]; then
+  build
+  exit 0
+fi
+
+results="" baseline=""
+while getopts "r:o:b:" opt; do
+  case $opt in
+    r) REPEATS=$OPTARG ;;
+    o) results=$OPTARG ;;
+    b) baseline=$OPTARG ;;
+    *) sed -n '4,5p' "$0" | sed 's/^# //' >&2; exit 1 ;;
+  esac
+done
+shift $((OPTIND - 1))
+variants=("${@:-${ALL_VARIANTS[@]}}")
+
+commit=$(git -C "$REPO" rev-parse --short HEAD 2> /dev/null || echo unknown)
+if ! git -C "$REPO" diff --quiet HEAD -- '*.c' 2> /dev/null; then
+  commit="$commit-dirty"
+fi
+results=${results:-$REPO/bench_results/$commit.json}
+if [ -n "$baseline" ] && [ ! -f "$baseline" ]; then
+  baseline="$REPO/bench_results/$baseline.json"
+fi
+mkdir -p "$(dirname "$results")" || exit 1
+
+build
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+make_workload_files "$WORK"
+
+{
+  echo "{"
+  echo "  \"commit\": \"$commit\", \"date\": \"$(date -u +%Y-%m-%dT%H:%M:%SZ)\", \"cpus\": $(nproc), \"repeats\": $REPEATS,"
+  echo "  \"results\": ["
+} > "$results"
+
+port=$BASE_PORT
+first=1
+for variant in "${variants[@]}"; do
+  for workload in "${WORKLOADS[@]}"; do
+    read -r name uploads connections files <<< "$workload"
+    runs=()
+    for _ in $(seq "$REPEATS"); do
+      runs+=("$(cd "$WORK" && run_once "$variant" "$port" "$uploads" "$connections" $files)")
+      port=$((port + 1))
+      # A variant that hangs or crashes will do it again; do not wait out every repeat
+      [[ ${runs[-1]} == *'"error"'* ]] && break
+    done
+    # Keep the median run by throughput
+    median=$(printf '%s\n' "${runs[@]}" | sort -n -k1,1 | sed -n "$(( (${#runs[@]} + 1) / 2 ))p")
+    line="    {\"variant\": \"$variant\", \"workload\": \"$name\", \"uploads\": $uploads, \"connections\": $connections, ${median#* }}"
+    [ $first -eq 1 ] || echo "," >> "$results"
+    printf '%s' "$line" >> "$results"
+    first=0
+    echo "$line" | sed 's/^ *//'
+  done
+done
+printf '\n  ]\n}\n' >> "$results"
+echo "Results written to $results"
+
+if [ -n "$baseline" ]; then
+  echo "Change against $baseline:"
+  compare "$baseline" "$results"
+fi
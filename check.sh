@@ -0,0 +1,294 @@
+#!/bin/bash
+
+# Behaviour checks for server5 that need a running server and real sockets
+# Usage: ./check.sh [check...]
+# Checks: query_handshake corrupt_index pipeline_backpressure uring_budget fd_limit (default: all of them)
+# Every check runs against each I/O backend and the pipeline, in a scratch directory of its own.
+# Exits non-zero if any check fails.
+
+BASE_PORT=24400            # Each server listens on a fresh port, from a run-specific offset above this
+SEARCH_TERM="the"
+MODES=("" "-i uring" "-P 1,2,1")
+
+ALL_CHECKS=(query_handshake corrupt_index pipeline_backpressure uring_budget fd_limit)
+
+REPO=$(cd "$(dirname "$0")" && pwd)
+BUILD="$REPO/check_build"
+port=$((BASE_PORT + $$ % 400 * 20))  # Ports a recent run left in TIME_WAIT are unlikely to come up again
+failures=0
+
+# Compile the server and the load generator
+build() {
+  mkdir -p "$BUILD" || exit 1
+  gcc -O2 -pthread "$REPO/server5.c" -o "$BUILD/server5" || exit 1
+  gcc -O2 -pthread "$REPO/loadgen.c" -o "$BUILD/loadgen" || exit 1
+}
+
+# Wait until the server listens on the port, without connecting to it (a connection would be a book)
+wait_for_listen() {
+  local hex
+  hex=$(printf ':%04X ' "$1")
+  for _ in $(seq 100); do
+    grep -q "$hex[0-9A-F:]* 0A " /proc/net/tcp && return 0
+    kill -0 "$pid" 2> /dev/null || return 1
+    sleep 0.05
+  done
+  return 1
+}
+
+# Start server5 in the current directory on a fresh port with extra options; sets port and pid.
+# A port an earlier run left in TIME_WAIT cannot be bound, so the next one is tried.
+# FILE_LIMIT lowers the server's descriptor limit
+start_server() {
+  for _ in 1 2 3 4 5; do
+    port=$((port + 1))
+    (ulimit -n "${FILE_LIMIT:-$(ulimit -n)}" && exec "$BUILD/server5" -l "$port" -p "$SEARCH_TERM" "$@" > server.out 2> server.err) &
+    pid=$!
+    wait_for_listen "$port" && return 0
+    stop_server
+  done
+  return 1
+}
+
+stop_server() {
+  kill "$pid" 2> /dev/null
+  wait "$pid" 2> /dev/null
+}
+
+# Send one query line after the handshake and print the reply. The handshake goes out in two
+# writes, so the server has to wait for all of it before it can tell a query from an upload
+query() {
+  exec 3<> "/dev/tcp/127.0.0.1/$port" || return 1
+  printf '\0QUE' >&3
+  sleep 0.1
+  printf 'RY\n%s\n' "$1" >&3
+  cat <&3
+  exec 3>&-
+}
+
+# Record a check's outcome
+report() {
+  if [ "$2" -eq 0 ]; then
+    echo "PASS $1"
+  else
+    echo "FAIL $1: $3"
+    failures=$((failures + 1))
+  fi
+}
+
+# An upload that starts with what looks like a command is still a book; only the handshake makes a query
+check_query_handshake() {
+  local mode=$1
+  printf '?rank\n?book 1\nIs the fox quick?\nthe end\n' > question.txt
+  start_server $mode || { report "query_handshake [${mode:-epoll}]" 1 "server did not start"; return; }
+  "$BUILD/loadgen" -l "$port" -c 1 -n 1 question.txt > /dev/null
+  sleep 0.2
+  local rank lines
+  rank=$(query "rank")
+  lines=$(query "book 1")
+  stop_server
+
+  if ! cmp -s question.txt book_01.txt; then
+    report "query_handshake [${mode:-epoll}]" 1 "upload starting with '?' was not stored as book_01.txt"
+  elif [ "$rank" != "book_01.txt 2" ]; then
+    report "query_handshake [${mode:-epoll}]" 1 "rank reply was '$rank'"
+  elif [ "$lines" != "$(grep "$SEARCH_TERM" question.txt)" ]; then
+    report "query_handshake [${mode:-epoll}]" 1 "book reply was '$lines'"
+  else
+    report "query_handshake [${mode:-epoll}]" 0
+  fi
+}
+
+# Overwrite bytes of a file in place with the given printf escapes
+patch_file() {
+  printf "$3" | dd of="$1" bs=1 seek="$2" conv=notrunc status=none
+}
+
+# A stored index that is cut short or points outside its own arrays is skipped at startup, so a
+# query never reads past the mappings; an intact one still loads. Offsets follow the IndexHeader
+# (40 bytes) and one IndexPattern (40 bytes) of a single search term
+check_corrupt_index() {
+  local mode=$1 name reply
+  printf 'the fox\nno match\nthe end\n' > book.txt
+  start_server $mode || { report "corrupt_index [${mode:-epoll}]" 1 "server did not start"; return; }
+  "$BUILD/loadgen" -l "$port" -c 1 -n 1 book.txt > /dev/null
+  sleep 0.2
+  stop_server
+  cp book_01.idx intact.idx
+
+  local match_offset
+  match_offset=$(od -An -t u8 -j 56 -N 8 intact.idx | tr -d ' ')
+  for name in truncated line_count first_offset offset_order match_line; do
+    cp intact.idx book_01.idx
+    case $name in
+      truncated) truncate -s 88 book_01.idx ;;
+      line_count) patch_file book_01.idx 24 '\xff\xff\xff\xff\xff\xff\xff\x1f' ;;  # Times 8 wraps to a small size
+      first_offset) patch_file book_01.idx 80 '\x00\x10' ;;
+      offset_order) patch_file book_01.idx 88 '\x00\x00' ;;
+      match_line) patch_file book_01.idx "$match_offset" '\x03' ;;
+    esac
+    start_server $mode || { report "corrupt_index [${mode:-epoll}]" 1 "server did not start"; return; }
+    reply=$(query "book 1")
+    stop_server
+    if [ "$reply" != "ERROR no such book in memory" ] || ! grep -q "Skipping stored book 1" server.err; then
+      report "corrupt_index [${mode:-epoll}]" 1 "$name index was loaded (reply '$reply')"
+      return
+    fi
+  done
+
+  cp intact.idx book_01.idx
+  start_server $mode || { report "corrupt_index [${mode:-epoll}]" 1 "server did not start"; return; }
+  reply=$(query "book 1")
+  stop_server
+  if [ "$reply" != "$(grep "$SEARCH_TERM" book.txt)" ]; then
+    report "corrupt_index [${mode:-epoll}]" 1 "intact index did not load (reply '$reply')"
+  else
+    report "corrupt_index [${mode:-epoll}]" 0
+  fi
+}
+
+# Time one rank query in milliseconds; prints nothing if there is no reply within 5 seconds
+timed_rank() {
+  local started reply
+  started=$(date +%s%N)
+  reply=$(timeout 5 bash -c "exec 3<> /dev/tcp/127.0.0.1/$port && printf '\\0QUERY\\nrank\\n' >&3 && cat <&3")
+  [ -n "$reply" ] && echo $((($(date +%s%N) - started) / 1000000))
+}
+
+# Uploads that outrun the pipeline's writer fill the rings between stages; the receive stage then
+# parks those connections instead of blocking, so queries keep being answered and every book still
+# arrives whole. A FIFO in place of the first book's file holds the writer in open() for as long as
+# nothing reads it, which fills every ring. Only meaningful for the pipeline, so other modes are skipped
+check_pipeline_backpressure() {
+  local mode=$1 ms loadgen
+  [[ $mode == -P* ]] || return
+  seq 250000 | sed "s/.*/line & of the big book, with the term in it/" > big.txt
+
+  mkfifo book_01.txt
+  start_server $mode -w 4096 || { report "pipeline_backpressure [$mode]" 1 "server did not start"; return; }
+  "$BUILD/loadgen" -l "$port" -c 4 -n 4 big.txt > /dev/null &
+  loadgen=$!
+  sleep 1
+  ms=$(timed_rank)
+  stop_server
+  kill $loadgen 2> /dev/null
+  wait $loadgen 2> /dev/null
+  if [ -z "$ms" ]; then
+    report "pipeline_backpressure [$mode]" 1 "a query went unanswered while the writer was stalled"
+    return
+  fi
+
+  rm -f book_*
+  head -n 20000 big.txt > book.txt
+  local slow=0 stored=0 file
+  start_server $mode -w 4096 || { report "pipeline_backpressure [$mode]" 1 "server did not start"; return; }
+  "$BUILD/loadgen" -l "$port" -c 8 -n 32 book.txt > /dev/null &
+  loadgen=$!
+  for _ in $(seq 10); do
+    ms=$(timed_rank)
+    [ -n "$ms" ] && [ "$ms" -lt 2000 ] || slow=$((slow + 1))
+    sleep 0.05
+  done
+  wait $loadgen
+  sleep 0.5
+  stop_server
+  for file in book_*.txt; do
+    cmp -s book.txt "$file" && stored=$((stored + 1))
+  done
+  if [ $slow -gt 0 ]; then
+    report "pipeline_backpressure [$mode]" 1 "$slow of 10 queries took over 2s during uploads"
+  elif [ $stored -ne 32 ]; then
+    report "pipeline_backpressure [$mode]" 1 "only $stored of 32 books were stored intact"
+  else
+    report "pipeline_backpressure [$mode]" 0
+  fi
+}
+
+# Uploads parked over a byte budget give their io_uring receive buffers back, so with more uploads
+# than the 256 shared buffers a query still gets one and is answered, and every book still arrives
+# whole. Uploads trickle in so each is parked mid-stream; with the FIFO stalling the writer as above,
+# none of them is ever resumed. The budget is per connection, which a query's empty book never reaches.
+# Only meaningful for io_uring, so other modes are skipped
+check_uring_budget() {
+  local mode=$1 ms loadgen
+  [[ $mode == "-i uring" ]] || return
+  seq 20000 | sed "s/.*/line & of the book, with the term in it/" > big.txt
+
+  mkfifo book_01.txt
+  start_server $mode -w 4096 -c 65536 || { report "uring_budget [$mode]" 1 "server did not start"; return; }
+  "$BUILD/loadgen" -l "$port" -c 300 -n 300 -r 256 big.txt > /dev/null &
+  loadgen=$!
+  sleep 3
+  ms=$(timed_rank)
+  stop_server
+  kill $loadgen 2> /dev/null
+  wait $loadgen 2> /dev/null
+  if [ -z "$ms" ]; then
+    report "uring_budget [$mode]" 1 "a query went unanswered while uploads were parked"
+    return
+  fi
+
+  rm -f book_*
+  head -n 5000 big.txt > book.txt
+  local stored=0 file
+  start_server $mode -w 4096 -c 65536 -g 1048576 || { report "uring_budget [$mode]" 1 "server did not start"; return; }
+  timeout 60 "$BUILD/loadgen" -l "$port" -c 300 -n 300 -r 256 book.txt > /dev/null
+  sleep 1
+  stop_server
+  for file in book_*.txt; do
+    cmp -s book.txt "$file" && stored=$((stored + 1))
+  done
+  if [ $stored -ne 300 ]; then
+    report "uring_budget [$mode]" 1 "only $stored of 300 books were stored intact"
+  else
+    report "uring_budget [$mode]" 0
+  fi
+}
+
+# More uploads at once than the server has descriptors for: the ones beyond its connection limit
+# wait in the backlog, rather than failing accept() and taking the server down, and all get stored
+check_fd_limit() {
+  local mode=$1 stored=0 file
+  seq 2000 | sed "s/.*/line & of the book, with the term in it/" > book.txt
+  FILE_LIMIT=128 start_server $mode || { report "fd_limit [${mode:-epoll}]" 1 "server did not start"; return; }
+  timeout 60 "$BUILD/loadgen" -l "$port" -c 200 -n 200 -r 256 book.txt > loadgen.out
+  sleep 1
+  if ! kill -0 "$pid" 2> /dev/null; then
+    report "fd_limit [${mode:-epoll}]" 1 "server exited: $(tail -n 1 server.err)"
+    return
+  fi
+  stop_server
+  for file in book_*.txt; do
+    cmp -s book.txt "$file" && stored=$((stored + 1))
+  done
+  if [ $stored -ne 200 ]; then
+    report "fd_limit [${mode:-epoll}]" 1 "only $stored of 200 books were stored intact ($(grep '^uploads:' loadgen.out))"
+  elif ! grep -q "not accepting more" server.err; then
+    report "fd_limit [${mode:-epoll}]" 1 "the server never reached its connection limit"
+  else
+    report "fd_limit [${mode:-epoll}]" 0
+  fi
+}
+
+checks=("${@:-${ALL_CHECKS[@]}}")
+build
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+for check in "${checks[@]}"; do
+  if ! declare -F "check_$check" > /dev/null; then
+    sed -n '4,5p' "$0" | sed 's/^# //' >&2
+    exit 1
+  fi
+  for mode in "${MODES[@]}"; do
+    dir=$(mktemp -d "$WORK/$check.XXXXXX")
+    cd "$dir" && "check_$check" "$mode"
+  done
+done
+
+if [ $failures -eq 0 ]; then
+  echo "All checks passed"
+else
+  echo "$failures check(s) failed"
+fi
+exit $((failures > 0))
@@ -0,0 +1,123 @@
+// Microbenchmark for the single-term counting kernels in server5.c
+// Build: gcc -O2 -pthread count_bench.c -o count_bench
+// Usage: ./count_bench <pattern> <file> [file...]
+
+#define main server5_main  // Reuse the server's kernels without its main()
+#include "server5.c"
+#undef main
+
+#include <time.h>
+
+#define BENCH_REPEATS 50  // Passes over each file per kernel
+
+// Wall-clock time in seconds
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The loop add_node_to_book_list used before the kernels: strstr, advancing one byte per hit
+size_t count_occurrences_strstr(const char *text, size_t len, const char *pattern, size_t pattern_len) {
+    (void)len;
+    (void)pattern_len;
+    const char *temp_str = text;
+    size_t count = 0;
+    while ((temp_str = strstr(temp_str, pattern)) != NULL) {
+        count++;
+        temp_str++;
+    }
+    return count;
+}
+
+// Run one kernel over every line of the text and report its throughput
+void bench_kernel(const char *name, count_kernel_fn kernel, const char *text, size_t len,
+                  const char *pattern, size_t pattern_len, size_t expected) {
+    size_t count = 0;
+    double start = now_seconds();
+
+    for (int r = 0; r < BENCH_REPEATS; r++) {
+        const char *pos = text;
+        const char *end = text + len;
+        while (pos < end) {
+            const char *newline = memchr(pos, '\n', end - pos);
+            size_t line_len = newline != NULL ? (size_t)(newline - pos) + 1 : (size_t)(end - pos);
+            count += kernel(pos, line_len, pattern, pattern_len);
+            pos += line_len;
+        }
+    }
+
+    double elapsed = now_seconds() - start;
+    printf("  %-8s %9.1f MB/s  %zu matches%s\n", name, len * (double)BENCH_REPEATS / elapsed / 1e6,
+           count / BENCH_REPEATS, count / BENCH_REPEATS == expected ? "" : "  MISMATCH");
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <pattern> <file> [file...]\n", argv[0]);
+        exit(1);
+    }
+
+    const char *pattern = argv[1];
+    size_t pattern_len = strlen(pattern);
+    if (pattern_len == 0) {
+        fprintf(stderr, "ERROR: Pattern must not be empty\n");
+        exit(1);
+    }
+
+    for (int f = 2; f < argc; f++) {
+        FILE *file = fopen(argv[f], "rb");
+        if (file == NULL) {
+            error("ERROR opening file");
+        }
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+
+        // A copy with every newline replaced by a NUL gives strstr the same lines in place
+        char *text = malloc(size + 1);
+        char *lines = malloc(size + 1);
+        if (text == NULL || lines == NULL || fread(text, 1, size, file) != (size_t)size) {
+            error("ERROR reading file");
+        }
+        fclose(file);
+        text[size] = '\0';
+        memcpy(lines, text, size + 1);
+        for (char *c = lines; (c = memchr(c, '\n', lines + size - c)) != NULL; c++) {
+            *c = '\0';
+        }
+
+        size_t expected = count_occurrences_scalar(text, size, pattern, pattern_len);
+        printf("%s (%ld bytes, pattern \"%s\")\n", argv[f], size, pattern);
+
+        // strstr stops at the first NUL, so it walks the copy one line at a time
+        size_t strstr_count = 0;
+        double start = now_seconds();
+        for (int r = 0; r < BENCH_REPEATS; r++) {
+            const char *pos = text;
+            const char *end = text + size;
+            while (pos < end) {
+                const char *newline = memchr(pos, '\n', end - pos);
+                size_t line_len = newline != NULL ? (size_t)(newline - pos) + 1 : (size_t)(end - pos);
+                strstr_count += count_occurrences_strstr(lines + (pos - text), line_len, pattern, pattern_len);
+                pos += line_len;
+            }
+        }
+        double elapsed = now_seconds() - start;
+        printf("  %-8s %9.1f MB/s  %zu matches%s\n", "strstr", size * (double)BENCH_REPEATS / elapsed / 1e6,
+               strstr_count / BENCH_REPEATS, strstr_count / BENCH_REPEATS == expected ? "" : "  MISMATCH");
+
+        bench_kernel("scalar", count_occurrences_scalar, text, size, pattern, pattern_len, expected);
+#if defined(__x86_64__) || defined(__i386__)
+        bench_kernel("sse2", count_occurrences_sse2, text, size, pattern, pattern_len, expected);
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            bench_kernel("avx2", count_occurrences_avx2, text, size, pattern, pattern_len, expected);
+        }
+#endif
+
+        free(text);
+        free(lines);
+    }
+    return 0;
+}
@@ -0,0 +1,184 @@
+// Scaling benchmark for per-line ingestion in server5.c: each doubling of a book should leave its
+// time per line about the same (x1.0), where appending by walking the list doubles it (x2.0)
+// Build: gcc -O2 -pthread ingest_bench.c -o ingest_bench
+// Usage: ./ingest_bench [pattern] [file...]   (default: the vegetarian.txt aldyths.txt)
+
+#define main server5_main  // Reuse the server's ingestion without its main()
+#include "server5.c"
+#undef main
+
+#include <time.h>
+
+#define MAX_COPIES 32         // Largest book, in copies of the file
+#define BENCH_REPEATS 3       // Uploads of each size; the fastest is kept
+#define MAX_WALK_COPIES 4     // The walking append is quadratic; larger books would take minutes
+
+// Wall-clock time in seconds
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The append add_node_to_book_list used before the book kept tail pointers: walk from the head
+// of both lists to their last node for every line
+void add_node_walking(size_t offset, size_t length, int found_occurrences, Book *book) {
+    Node *new_node = (Node *)arena_alloc(&book->arena, sizeof(Node));
+    new_node->offset = offset;
+    new_node->length = length;
+    new_node->book_next = NULL;
+    new_node->next_frequent_search = NULL;
+
+    if (book->book_head == NULL) {
+        book->book_head = new_node;
+    } else {
+        Node *last = book->book_head;
+        while (last->book_next != NULL) {
+            last = last->book_next;
+        }
+        last->book_next = new_node;
+    }
+    if (found_occurrences > 0) {
+        if (book->frequent_search_head == NULL) {
+            book->frequent_search_head = new_node;
+        } else {
+            Node *last = book->frequent_search_head;
+            while (last->next_frequent_search != NULL) {
+                last = last->next_frequent_search;
+            }
+            last->next_frequent_search = new_node;
+        }
+    }
+}
+
+// Upload text as one book through the server's ingestion path, a socket read's worth at a time,
+// and free the book again; returns the seconds it took and the lines indexed
+double ingest_book(const char *text, size_t len, size_t *lines) {
+    Connection *conn = create_connection(-1, NULL);
+    Book *book = conn->book;
+
+    double start = now_seconds();
+    for (size_t pos = 0; pos < len; pos += BUFFER_SIZE) {
+        size_t n = len - pos < BUFFER_SIZE ? len - pos : BUFFER_SIZE;
+        grow_text(book, n);
+        memcpy(book->text + book->text_len, text + pos, n);
+        book->text_len += n;
+        index_received_bytes(conn, 0);
+    }
+    index_received_bytes(conn, 1);
+    double elapsed = now_seconds() - start;
+
+    *lines = book->line_count;
+    unregister_book(book);
+    remove_book_from_ranking(book);
+    release_book(book);
+    release_connection(conn);
+    return elapsed;
+}
+
+// Append every line of text to a fresh book's lists with one of the two appends; returns the seconds it took
+double append_lines(void (*append)(size_t, size_t, int, Book *), const char *text, size_t len,
+                    const char *pattern) {
+    Book book;
+    memset(&book, 0, sizeof(book));
+    book.text = (char *)text;  // The lines are views into it, as into a received book
+    book.text_len = len;
+
+    double start = now_seconds();
+    const char *pos = text;
+    const char *end = text + len;
+    while (pos < end) {
+        const char *newline = memchr(pos, '\n', end - pos);
+        size_t line_len = newline != NULL ? (size_t)(newline - pos) + 1 : (size_t)(end - pos);
+        int found = memmem(pos, line_len, pattern, strlen(pattern)) != NULL;
+        append(pos - text, line_len, found, &book);
+        pos += line_len;
+    }
+    double elapsed = now_seconds() - start;
+
+    arena_free(&book.arena);
+    return elapsed;
+}
+
+// Lines in text, counting an unterminated last one
+size_t count_lines(const char *text, size_t len) {
+    size_t lines = 0;
+    for (const char *c = text; (c = memchr(c, '\n', text + len - c)) != NULL; c++) {
+        lines++;
+    }
+    return lines + (len > 0 && text[len - 1] != '\n');
+}
+
+int main(int argc, char *argv[]) {
+    const char *pattern = argc > 1 ? argv[1] : "the";
+    const char *default_files[] = {"vegetarian.txt", "aldyths.txt"};
+    const char **files = argc > 2 ? (const char **)argv + 2 : default_files;
+    int file_count = argc > 2 ? argc - 2 : 2;
+    if (pattern[0] == '\0') {
+        fprintf(stderr, "Usage: %s [pattern] [file...]\n", argv[0]);
+        exit(1);
+    }
+
+    log_level = LOG_WARN;
+    add_search_term(pattern);
+    build_automaton(&automaton, search_terms, search_term_count);
+    search_term_length = strlen(search_terms[0]);
+    count_occurrences = select_count_kernel();
+    init_registry();
+
+    for (int f = 0; f < file_count; f++) {
+        FILE *file = fopen(files[f], "rb");
+        if (file == NULL) {
+            error("ERROR opening file");
+        }
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+
+        // The largest book is every copy back to back; the smaller ones are its prefixes
+        char *text = malloc(size * MAX_COPIES);
+        if (text == NULL || fread(text, 1, size, file) != (size_t)size) {
+            error("ERROR reading file");
+        }
+        fclose(file);
+        for (int c = 1; c < MAX_COPIES; c++) {
+            memcpy(text + c * size, text, size);
+        }
+        printf("%s (%ld bytes, pattern \"%s\")\n", files[f], size, pattern);
+
+        // The whole ingestion path, as a worker runs it for each socket read. A step where the book
+        // outgrows a cache shows once; a quadratic step would show at every doubling
+        double previous = 0;
+        for (int copies = 1; copies <= MAX_COPIES; copies *= 2) {
+            size_t lines;
+            double elapsed = ingest_book(text, size * copies, &lines);
+            for (int r = 1; r < BENCH_REPEATS; r++) {
+                double again = ingest_book(text, size * copies, &lines);
+                elapsed = again < elapsed ? again : elapsed;
+            }
+            double ns = elapsed / lines * 1e9;
+            printf("  ingest  %2dx %8zu lines %9.2f ms %7.1f ns/line", copies, lines, elapsed * 1e3, ns);
+            printf(previous > 0 ? "  x%.2f\n" : "\n", ns / previous);
+            previous = ns;
+        }
+
+        // The list append alone, against the walk it replaced
+        double previous_tail = 0, previous_walk = 0;
+        for (int copies = 1; copies <= MAX_COPIES; copies *= 2) {
+            size_t lines = (size_t)copies * count_lines(text, size);
+            double tail = append_lines(add_node_to_book_list, text, size * copies, pattern) / lines * 1e9;
+            printf("  append  %2dx  tail %6.1f ns/line", copies, tail);
+            printf(previous_tail > 0 ? "  x%.2f" : "       ", tail / previous_tail);
+            previous_tail = tail;
+            if (copies <= MAX_WALK_COPIES) {
+                double walk = append_lines(add_node_walking, text, size * copies, pattern) / lines * 1e9;
+                printf("  walk %9.1f ns/line", walk);
+                printf(previous_walk > 0 ? "  x%.2f" : "", walk / previous_walk);
+                previous_walk = walk;
+            }
+            printf("\n");
+        }
+        free(text);
+    }
+    return 0;
+}
@@ -0,0 +1,285 @@
+// Load generator for server5: uploads the bundled corpora over many concurrent connections
+// Build: gcc -O2 -pthread loadgen.c -o loadgen
+// Usage: ./loadgen [-h host] [-l port] [-c connections] [-n uploads] [-r KB/s] [-a uploads/s] [-b chunk] [file...]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define DEFAULT_PORT 12345           // The port run_clients.sh has always used
+#define DEFAULT_CONNECTIONS 16       // Concurrent connections when -c is not given
+#define DEFAULT_UPLOADS 200          // Uploads in the run when -n is not given
+#define DEFAULT_CHUNK (64 * 1024)    // Bytes per write() when -b is not given
+#define PACED_CHUNKS_PER_SECOND 100  // With -r and no -b, each write carries 10 ms worth of the rate
+
+// One corpus file, read into memory once
+typedef struct Corpus {
+    const char *path;
+    char *data;
+    size_t len;
+} Corpus;
+
+// Files sent when none are named: everything bundled with the server
+const char *default_files[] = {"fox.txt", "aldyths.txt", "vegetarian.txt", "noplacelikehome.txt", "thegoldgenrule.txt",
+                               "a_chars.txt", "b_chars.txt", "c_chars.txt", "d_chars.txt", "e_chars.txt",
+                               "f_chars.txt", "g_chars.txt", "h_chars.txt", "i_chars.txt", "j_chars.txt"};
+
+struct sockaddr_storage server_addr;  // Resolved once, shared by every connection
+socklen_t server_addr_len;
+Corpus *corpora;
+int corpus_count;
+int total_uploads = DEFAULT_UPLOADS;
+double rate_per_connection = 0;      // Bytes per second each connection sends; 0 sends flat out
+double arrival_rate = 0;             // Uploads started per second across all connections; 0 starts them back to back
+size_t chunk_size = 0;             // Bytes per write(); 0 until options are parsed
+double run_start;                    // When the first upload was due
+
+atomic_int next_upload;              // Next upload number to hand out
+atomic_int failed_uploads;
+atomic_int last_failure;             // errno of the most recent failed upload, for the report
+atomic_ullong bytes_sent;
+double *latencies;                   // Completion latency of every upload, in seconds; -1 if it failed
+
+// Function to handle errors
+void error(const char *msg) {
+    perror(msg);
+    exit(1);
+}
+
+// Wall-clock time in seconds
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Sleep until the given now_seconds() time, if it is still ahead
+void sleep_until(double when) {
+    double delay = when - now_seconds();
+    if (delay > 0) {
+        struct timespec ts = {(time_t)delay, (long)((delay - (time_t)delay) * 1e9)};
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+            ;
+    }
+}
+
+// Read a whole file into memory
+void load_corpus(Corpus *corpus, const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        error(path);
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    corpus->path = path;
+    corpus->data = malloc(size > 0 ? size : 1);
+    corpus->len = size;
+    if (corpus->data == NULL || fread(corpus->data, 1, size, file) != (size_t)size) {
+        error("ERROR reading corpus");
+    }
+    fclose(file);
+}
+
+// Upload one corpus over a fresh connection and wait for the server to close it, which it does
+// once the book is complete; returns 0, or -1 if the connection failed
+int upload(const Corpus *corpus) {
+    int sockfd = socket(server_addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sockfd < 0) {
+        error("ERROR opening socket");
+    }
+    if (connect(sockfd, (struct sockaddr *)&server_addr, server_addr_len) < 0) {
+        int saved = errno;
+        close(sockfd);
+        errno = saved;
+        return -1;
+    }
+
+    // Paced connections send small chunks as their schedule allows; others fill the socket
+    double start = now_seconds();
+    size_t sent = 0;
+    while (sent < corpus->len) {
+        size_t len = corpus->len - sent < chunk_size ? corpus->len - sent : chunk_size;
+        if (rate_per_connection > 0) {
+            sleep_until(start + sent / rate_per_connection);
+        }
+        ssize_t n = send(sockfd, corpus->data + sent, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            int saved = n < 0 ? errno : ECONNRESET;
+            close(sockfd);
+            errno = saved;
+            return -1;
+        }
+        sent += n;
+        atomic_fetch_add_explicit(&bytes_sent, n, memory_order_relaxed);
+    }
+
+    // The end of the stream completes the book; the server closes the socket when it has it
+    char buffer[256];
+    ssize_t n;
+    shutdown(sockfd, SHUT_WR);
+    while ((n = read(sockfd, buffer, sizeof(buffer))) > 0 || (n < 0 && errno == EINTR))
+        ;
+    int saved = errno;
+    close(sockfd);
+    errno = saved;
+    return n == 0 ? 0 : -1;
+}
+
+// Each thread keeps one connection busy: take the next upload, wait for its slot, send it
+void *connection_thread_func(void *arg) {
+    (void)arg;
+    while (1) {
+        int i = atomic_fetch_add(&next_upload, 1);
+        if (i >= total_uploads) {
+            return NULL;
+        }
+
+        // With a fixed arrival rate, latency counts from when the upload was due, so time spent
+        // waiting for a free connection behind a slow server is not hidden
+        double due = now_seconds();
+        if (arrival_rate > 0) {
+            due = run_start + i / arrival_rate;
+            sleep_until(due);
+        }
+        if (upload(&corpora[i % corpus_count]) < 0) {
+            atomic_store(&last_failure, errno);
+            atomic_fetch_add(&failed_uploads, 1);
+            latencies[i] = -1;
+        } else {
+            latencies[i] = now_seconds() - due;
+        }
+    }
+}
+
+// Compare latencies for qsort
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Latency at the given percentile of count sorted values
+double percentile(const double *sorted, int count, double p) {
+    int i = (int)(p / 100 * count + 0.5) - 1;
+    return sorted[i < 0 ? 0 : i >= count ? count - 1 : i];
+}
+
+int main(int argc, char *argv[]) {
+    const char *host = "127.0.0.1";
+    int port = DEFAULT_PORT, connections = DEFAULT_CONNECTIONS;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "h:l:c:n:r:a:b:")) != -1) {
+        switch (opt) {
+        case 'h':
+            host = optarg;
+            break;
+        case 'l':
+            port = atoi(optarg);
+            break;
+        case 'c':
+            connections = atoi(optarg);
+            break;
+        case 'n':
+            total_uploads = atoi(optarg);
+            break;
+        case 'r':
+            rate_per_connection = atof(optarg) * 1024;
+            break;
+        case 'a':
+            arrival_rate = atof(optarg);
+            break;
+        case 'b':
+            chunk_size = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            port = -1;
+            break;
+        }
+    }
+    if (chunk_size == 0) {
+        chunk_size = rate_per_connection > 0 ? (size_t)(rate_per_connection / PACED_CHUNKS_PER_SECOND) + 1 : DEFAULT_CHUNK;
+    }
+    if (port <= 0 || connections < 1 || total_uploads < 1 || rate_per_connection < 0 || arrival_rate < 0) {
+        fprintf(stderr, "Usage: %s [-h host] [-l port] [-c connections] [-n uploads] [-r KB/s per connection] "
+                        "[-a uploads/s] [-b chunk_bytes] [file...]\n", argv[0]);
+        exit(1);
+    }
+
+    // Resolve the server once
+    char service[16];
+    struct addrinfo hints, *result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;  // The server listens on IPv4 only
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &result) != 0) {
+        fprintf(stderr, "ERROR, no such host\n");
+        exit(1);
+    }
+    memcpy(&server_addr, result->ai_addr, result->ai_addrlen);
+    server_addr_len = result->ai_addrlen;
+    freeaddrinfo(result);
+
+    // Uploads cycle through the files in order
+    corpus_count = optind < argc ? argc - optind : (int)(sizeof(default_files) / sizeof(default_files[0]));
+    corpora = calloc(corpus_count, sizeof(Corpus));
+    latencies = calloc(total_uploads, sizeof(double));
+    if (corpora == NULL || latencies == NULL) {
+        error("ERROR allocating load generator state");
+    }
+    for (int i = 0; i < corpus_count; i++) {
+        load_corpus(&corpora[i], optind < argc ? argv[optind + i] : default_files[i]);
+    }
+
+    pthread_t *threads = calloc(connections, sizeof(pthread_t));
+    if (threads == NULL) {
+        error("ERROR allocating threads");
+    }
+    run_start = now_seconds();
+    for (int i = 0; i < connections; i++) {
+        if (pthread_create(&threads[i], NULL, connection_thread_func, NULL) != 0) {
+            error("ERROR creating thread");
+        }
+    }
+    for (int i = 0; i < connections; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now_seconds() - run_start;
+
+    // Percentiles over the uploads that completed
+    int completed = 0;
+    for (int i = 0; i < total_uploads; i++) {
+        if (latencies[i] >= 0) {
+            latencies[completed++] = latencies[i];
+        }
+    }
+    qsort(latencies, completed, sizeof(double), compare_doubles);
+
+    unsigned long long bytes = atomic_load(&bytes_sent);
+    printf("uploads: %d completed, %d failed, %d connections, %d files\n", completed, atomic_load(&failed_uploads),
+           connections, corpus_count);
+    if (atomic_load(&failed_uploads) > 0) {
+        printf("last failure: %s\n", strerror(atomic_load(&last_failure)));
+    }
+    printf("elapsed: %.3f s, %.1f connections/s, %.1f MB/s\n", elapsed, completed / elapsed, bytes / elapsed / 1e6);
+    if (completed > 0) {
+        printf("latency: p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, p99.9 %.2f ms, max %.2f ms\n",
+               percentile(latencies, completed, 50) * 1e3, percentile(latencies, completed, 90) * 1e3,
+               percentile(latencies, completed, 99) * 1e3, percentile(latencies, completed, 99.9) * 1e3,
+               latencies[completed - 1] * 1e3);
+    }
+    return atomic_load(&failed_uploads) > 0 ? 1 : 0;
+}
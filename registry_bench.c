@@ -0,0 +1,86 @@
+// Microbenchmark for the book registry in server5.c
+// Build: gcc -O2 -pthread registry_bench.c -o registry_bench
+// Usage: ./registry_bench [books] [max_completed_books]
+
+#define main server5_main  // Reuse the server's registry without its main()
+#include "server5.c"
+#undef main
+
+#include <time.h>
+
+#define DEFAULT_BENCH_BOOKS 1000000  // Books registered when no count is given
+
+// Wall-clock time in seconds
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Peak resident set size of this process in kB, from /proc
+long peak_rss_kb(void) {
+    char line[256];
+    long kb = -1;
+    FILE *file = fopen("/proc/self/status", "r");
+    if (file == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (strncmp(line, "VmHWM:", 6) == 0) {
+            kb = atol(line + 6);
+        }
+    }
+    fclose(file);
+    return kb;
+}
+
+int main(int argc, char *argv[]) {
+    int book_total = argc > 1 ? atoi(argv[1]) : DEFAULT_BENCH_BOOKS;
+    max_completed_books = argc > 2 ? atoi(argv[2]) : DEFAULT_MAX_COMPLETED_BOOKS;
+    if (book_total < 1 || max_completed_books < 0) {
+        fprintf(stderr, "Usage: %s [books] [max_completed_books]\n", argv[0]);
+        exit(1);
+    }
+
+    add_search_term("the");
+    init_registry();
+
+    // Register, complete and (past the cap) evict every book, as finish_client and the writer thread do
+    double start = now_seconds();
+    for (int i = 0; i < book_total; i++) {
+        Book *book = create_book();
+        atomic_store(&book->written, 1);  // Nothing goes to disk here
+        pthread_mutex_lock(&list_mutex);
+        add_node_to_global_list(book);
+        pthread_mutex_unlock(&list_mutex);
+        evict_completed_books();
+    }
+    double elapsed = now_seconds() - start;
+    printf("register+complete: %d books, %.1f ns/book, %d resident, peak RSS %ld kB\n",
+           book_total, elapsed / book_total * 1e9, completed_book_count, peak_rss_kb());
+
+    // Look up every id ever handed out, in a scattered order, as a query does; evicted ones miss
+    int found = 0;
+    start = now_seconds();
+    for (int i = 0; i < book_total; i++) {
+        int id = (int)(((unsigned long)i * 7919) % (unsigned long)book_total) + 1;
+        Book *book = acquire_book(id);
+        if (book != NULL) {
+            found++;
+            release_book(book);
+        }
+    }
+    elapsed = now_seconds() - start;
+    printf("lookup: %d lookups, %.1f ns/lookup, %d hits\n", book_total, elapsed / book_total * 1e9, found);
+
+    // Report the top 10 straight from the heap
+    RankEntry entries[10];
+    for (int i = 0; i < 10; i++) {
+        entries[i].pattern_occurrences = NULL;
+    }
+    start = now_seconds();
+    int count = collect_top_books(entries, 10);
+    elapsed = now_seconds() - start;
+    printf("top-10 report over %d ranked books: %.1f us\n", count > 0 ? rank_heap_size : 0, elapsed * 1e6);
+    return 0;
+}
@@ -1,21 +1,21 @@
 #!/bin/bash
 
-# Number of clients to simulate
+# Number of concurrent client connections
 NUM_CLIENTS=10
 
 # Server address and port
 SERVER_ADDR="localhost"
 SERVER_PORT=12345
 
-#!/bin/bash
-
 files=("a_chars.txt" "b_chars.txt" "c_chars.txt" "d_chars.txt" "e_chars.txt" "f_chars.txt" "g_chars.txt" "h_chars.txt" "i_chars.txt" "j_chars.txt")
 
-for i in "${!files[@]}"; do
-  echo "Starting client $((i+1)) using file ${files[$i]}"
-  nc localhost 12345 < "${files[$i]}" &
-  sleep 0.5  # Add a delay of 0.5 seconds between clients
-done
+# Build the load generator if it is missing or older than its source
+if [ ! -x loadgen ] || [ loadgen.c -nt loadgen ]; then
+  gcc -O2 -pthread loadgen.c -o loadgen || exit 1
+fi
 
-wait  # Wait for all background clients to finish
+# One upload per file, all of them at once; pass extra loadgen options through (e.g. -n 1000 -r 64)
+./loadgen -h "$SERVER_ADDR" -l "$SERVER_PORT" -c "$NUM_CLIENTS" -n "${#files[@]}" "$@" "${files[@]}"
+status=$?
 echo "All clients finished"
+exit $status
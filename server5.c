@@ -1,3 +1,4 @@
+#define _GNU_SOURCE  // For memmem
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -8,382 +9,5283 @@
 #include <pthread.h>
 #include <fcntl.h>   // For non-blocking I/O
 #include <errno.h>   // For error handling
+#include <sys/epoll.h>  // For the event loop that owns all client sockets
+#include <stdatomic.h>  // For the lock-free occurrence counters
+#include <sys/uio.h>    // For writev
+#include <sys/mman.h>   // For mapping the io_uring queues
+#include <sys/syscall.h>  // For the io_uring system calls, which libc does not wrap
+#include <linux/io_uring.h>  // For the optional io_uring backend
+#include <stdint.h>     // For the fixed-width fields of the on-disk index
+#include <dirent.h>     // For finding stored books at startup
+#include <sys/stat.h>   // For sizing stored files before mapping them
+#include <signal.h>     // For ignoring SIGPIPE from clients that leave mid-reply
+#include <stdarg.h>     // For the logger's printf-style entry point
+#include <time.h>       // For log timestamps
+#include <sched.h>      // For pinning acceptor and pipeline threads to cores
+#include <linux/futex.h>  // For parking pipeline threads on empty or full rings
+#include <sys/eventfd.h>  // For waking a pipeline receiver inside its epoll loop
+#include <sys/resource.h>  // For keeping connections under the descriptor limit
+#include <limits.h>     // For INT_MAX
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>  // For the SSE2/AVX2 counting kernels
+#endif
 
-#define BUFFER_SIZE 1024  // Increased buffer size for long lines
-#define LINE_BUFFER_SIZE 2048  // Buffer size to accumulate a full line
-#define MAX_BOOKS 100         // Maximum number of books
+// ThreadSanitizer models EPOLL_CTL_ADD as a release to the epoll_wait() that reports the socket, but
+// not the EPOLL_CTL_MOD that re-arms a one-shot socket, so the hand-off of a connection from the
+// thread that re-armed it back to the reactor is annotated. The re-arm itself bypasses the
+// interceptor, whose access to the descriptor would come after the release and race with the next
+// handler's close()
+#if defined(__SANITIZE_THREAD__)
+#include <sys/syscall.h>
+void __tsan_acquire(void *addr);
+void __tsan_release(void *addr);
+#define TSAN_ACQUIRE(addr) __tsan_acquire(addr)
+#define TSAN_RELEASE(addr) __tsan_release(addr)
+#define rearm_epoll_ctl(epfd, op, fd, event) syscall(SYS_epoll_ctl, epfd, op, fd, event)
+#else
+#define TSAN_ACQUIRE(addr) ((void)0)
+#define TSAN_RELEASE(addr) ((void)0)
+#define rearm_epoll_ctl(epfd, op, fd, event) epoll_ctl(epfd, op, fd, event)
+#endif
+
+#define BUFFER_SIZE 1024  // Minimum free space in a book's text buffer before each read()
+#define TEXT_BUFFER_INITIAL (64 * 1024)  // Initial capacity of a book's text buffer
+#define READ_BUDGET (256 * 1024)  // Bytes a worker reads from one socket before yielding
+#define MATCH_TASK_BYTES (32 * 1024)  // Whole lines matched by one task of the work-stealing pool
+#define PARALLEL_MATCH_MIN (2 * MATCH_TASK_BYTES)  // Shorter runs of complete lines are matched inline
+#define TASK_DEQUE_SIZE 256       // Tasks a worker can have waiting for thieves (a power of two)
+#define STEAL_SPINS 16            // Failed passes over the other deques before an idle worker sleeps until more tasks are queued
+#define PIPELINE_BATCH_BYTES (64 * 1024)  // Bytes a receiver reads into one batch for the pipeline
+#define PIPELINE_RING_SIZE 64     // Batches queued between two pipeline threads (a power of two)
+#define PIPELINE_SPINS 64         // Polls of an empty or full ring before a pipeline thread sleeps
+#define REGISTRY_SHARDS 64    // Independently locked shards of the book registry
+#define DEFAULT_MAX_COMPLETED_BOOKS 1000  // Completed books kept in memory when -m is not given
+#define DEFAULT_GLOBAL_BUDGET (1024UL * 1024 * 1024)  // Bytes all uploads may hold when -g is not given; -g 0 lifts it
+#define MAX_EVENTS 64         // Maximum number of epoll events handled per wakeup
+#define DEFAULT_WORKER_THREADS 4  // Worker pool size when -t is not given
+#define DEFAULT_ACCEPTORS 1       // Listening sockets, each with its own reactor thread, when -a is not given
+#define DEFAULT_BACKLOG 1024      // Pending connections each listening socket queues when -b is not given (capped by somaxconn)
+#define FD_RESERVE 64             // Descriptors kept back from connections for listeners, book and index files
+#define ARENA_BLOCK_SIZE (64 * 1024)  // Size of each block carved up by a book's arena
+#define MAX_PATTERN_LENGTH 1024   // Longest line accepted from a pattern file
+#define CACHE_LINE_SIZE 64        // Counters written by different workers never share a line
+#define WRITE_BATCH_MAX 64        // Books the writer thread takes off its queue at once
+#define IOV_BATCH 1024            // Line segments handed to one writev() call
+
+// When the writer thread makes output files durable (-s)
+#define FSYNC_NONE 0              // Leave it to the kernel
+#define FSYNC_BOOK 1              // fdatasync() each file right after it is written
+#define FSYNC_BATCH 2             // Write a whole batch, then fdatasync() its files together
+
+// How sockets are read and book files written (-i)
+#define IO_BACKEND_EPOLL 0        // Readiness events, then read()/writev() from the threads
+#define IO_BACKEND_URING 1        // Completions from io_uring; falls back to epoll when unavailable
+#define URING_ENTRIES 256         // Submission queue slots of each ring
+#define RECV_BUFFER_COUNT 256     // Buffers the kernel picks socket data into (a power of two)
+#define RECV_BUFFER_SIZE (64 * 1024)  // Size of each of those buffers
+#define URING_WAIT_BATCH 32       // Completions the busy reactor waits to gather per io_uring_enter()
+#define URING_WAIT_NSEC 2000000   // ... but for no longer than this after the last batch
+#define RECV_BUFFER_GROUP 0       // Buffer group id of the provided-buffer ring
+#define URING_IOV_MAX 16          // Line segments of one book in one asynchronous writev
+#define URING_ACCEPT_TAG 0        // user_data of every accept
+#define URING_ACCEPT_DEPTH 16     // Single-shot accepts kept in flight; the connection limit caps them too
+#define URING_TIMEOUT_TAG 1       // user_data of the timeout that retries starved receives
+#define URING_CANCEL_TAG 2        // user_data of the cancel that ends a paused connection's receive
+#define INDEX_MAGIC "BOOKIDX1"    // First bytes of every sidecar index (book_NN.idx)
+#define QUERY_MAGIC "\0QUERY\n"   // Line that opens a connection asking for results; no text book starts with a NUL byte
+#define QUERY_MAGIC_LEN (sizeof(QUERY_MAGIC) - 1)
+#define MAX_QUERY_LENGTH 256      // Longest query line read before answering anyway
+#define QUERY_SEND_TIMEOUT 5      // Seconds a reply may wait on a client that stopped reading
+
+// Log levels (-v); a message is kept if its level is at most the configured one
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+#define LOG_TRACE 4
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOG_TRACE   // Build with -DLOG_MAX_LEVEL=LOG_INFO to compile debug and trace logging out
+#endif
+#define LOG_RECORD_SIZE 256       // Bytes per queued message, header included; longer ones are truncated
+#define LOG_RING_RECORDS 8192     // Messages each thread can queue before new ones are dropped (a power of two)
+#define LOG_FLUSH_BATCH 4096      // Messages the flusher writes per pass
+#define LOG_FLUSH_INTERVAL_NSEC 10000000  // Flusher sleep when every ring is empty
+
+// Log a printf-style message from any thread without taking a lock. Levels above LOG_MAX_LEVEL
+// compile to nothing, and a disabled level costs one load and a branch; the arguments are only
+// evaluated when the message is kept
+#define LOG(level, ...)                                              \
+    do {                                                             \
+        if ((level) <= LOG_MAX_LEVEL && (level) <= log_level)        \
+            log_write((level), __VA_ARGS__);                         \
+    } while (0)
+
+// Stages with a latency histogram on the metrics endpoint (-e)
+#define METRIC_ACCEPT 0           // Accepting one connection and registering it with the reactor
+#define METRIC_READ 1             // One read() from a socket, or copying one io_uring buffer
+#define METRIC_SPLIT 2            // accumulate_line(): splitting, matching and indexing one batch of bytes (pipeline: splitting only)
+#define METRIC_MATCH 3            // Matching one line's bytes (sampled)
+#define METRIC_ADD_NODE 4         // add_node_to_book_list() for one line (sampled)
+#define METRIC_SPLICE 5           // Appending a finished book to the global list, lock wait included
+#define METRIC_WRITE_BOOK 6       // write_book_to_file() for one book (epoll backend)
+#define METRIC_WRITE_BATCH 7      // One batch of the writer thread, syncs included
+#define METRIC_THROTTLED 8        // Time one connection spent throttled by the byte budgets, over its whole upload
+#define METRIC_STAGES 9
+
+// Counters on the metrics endpoint
+#define COUNTER_ACCEPTED 0        // Connections accepted
+#define COUNTER_BYTES_RECEIVED 1
+#define COUNTER_LINES 2           // Lines indexed
+#define COUNTER_MATCHES 3         // Occurrences of every search term
+#define COUNTER_BOOKS_WRITTEN 4
+#define COUNTER_BYTES_WRITTEN 5
+#define COUNTER_QUERIES 6         // Queries answered
+#define COUNTER_TASKS_STOLEN 7    // Matching tasks run by a worker other than the one that split them
+#define COUNTER_THROTTLES 8       // Times a connection stopped being read because of the byte budgets
+#define COUNTER_BOOKS_EVICTED 9   // Completed books dropped from memory by the retention policies
+#define METRIC_COUNTERS 10
+
+// Log-linear (HDR-style) latency buckets: HISTOGRAM_SUB_BUCKETS per power of two from
+// 2^HISTOGRAM_MIN_EXP ns up to 2^HISTOGRAM_MAX_EXP ns, so every bucket is within 25% of its bound
+#define HISTOGRAM_MIN_EXP 7       // 128 ns; faster samples share the first bucket
+#define HISTOGRAM_MAX_EXP 36      // About 69 s; slower samples only count towards +Inf
+#define HISTOGRAM_SUB_BITS 2
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS (2 + (HISTOGRAM_MAX_EXP - HISTOGRAM_MIN_EXP) * HISTOGRAM_SUB_BUCKETS)
+#define METRICS_SAMPLE_EVERY 256  // Per-line stages time one line in this many (a power of two)
+
+// Pipeline stages (-P): every connection's batches pass through one thread of each, in order
+#define STAGE_RECEIVE 0           // The acceptors' reactors: read sockets into batches
+#define STAGE_SPLIT 1             // Strip the BOM and cut batches at line boundaries
+#define STAGE_MATCH 2             // Count every term in every line
+#define STAGE_AGGREGATE 3         // Node list, index, counters, ranking and the global list
+#define STAGE_PERSIST 4           // The writer thread
+#define PIPELINE_STAGES 5
+
+// What the first bytes of a stream say it is (query_handshake())
+#define HANDSHAKE_UPLOAD 0        // Not QUERY_MAGIC: a book
+#define HANDSHAKE_QUERY 1         // QUERY_MAGIC in full
+#define HANDSHAKE_PENDING 2       // A prefix of QUERY_MAGIC so far
+
+// Whether a connection is a query (Connection.query)
+#define QUERY_NONE 0              // Uploading a book, or not known yet
+#define QUERY_PENDING 1           // Waiting for the rest of the query line
+#define QUERY_ANSWERED 2          // Replied to; only waiting for the socket to close
+
+// What check_budgets() lets a connection do before it reads (-c, -g)
+#define BUDGET_OK 0               // Read on
+#define BUDGET_THROTTLED 1        // Parked until the writer thread frees some bytes; the socket is left unread
+#define BUDGET_EXCEEDED 2         // Its incomplete line alone outgrew the connection budget: the upload ends
 
 // Linked list node structure
 typedef struct Node {
-    struct Node* next;               // Points to the next node in the global list
     struct Node* book_next;          // Points to the next node in the same book
-    char* data;
+    size_t offset;                   // Start of the line within the book's output file
+    size_t length;                   // Length of the line, including its newline
     struct Node* next_frequent_search; // Points to the next node containing the search term
 } Node;
 
+// One block of a bump arena; allocations are carved from data[]
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;         // Previously filled block
+    size_t used;                     // Bytes handed out from data[]
+    size_t size;                     // Capacity of data[]
+    char data[];
+} ArenaBlock;
+
+// Bump allocator for one book: its nodes are freed together in one shot
+typedef struct Arena {
+    ArenaBlock *current;             // Block allocations are carved from
+} Arena;
+
 // Book structure
 typedef struct Book {
-    char title[50];                  // Title of the book
-    int occurrences;                 // Total occurrences of the search term in the book
+    // Written only by the worker that owns the book's connection and read lock-free through
+    // counter_seq (a seqlock); kept on a cache line of their own
+    _Alignas(CACHE_LINE_SIZE) atomic_uint counter_seq;  // Odd while the counters are being updated
+    atomic_int occurrences;          // Total occurrences of all search terms in the book
+    atomic_int *pattern_occurrences; // Occurrences of each search term (cache-line aligned array)
+
+    _Alignas(CACHE_LINE_SIZE) char title[50];  // Title of the book
+    int id;                          // Connection order; names the output file
+    Node *book_head;                 // Head of the book-specific list (every line)
+    Node *book_tail;                 // Tail of the book-specific list, for O(1) appends
     Node *frequent_search_head;      // Head of the frequent search linked list
+    Node *frequent_search_tail;      // Tail of the frequent search linked list
+    struct Book *next;               // Next finished book in the global list
+    struct Book *registry_next;      // Next book in the same registry bucket
+    Arena arena;                     // Backing store for the book's nodes
+    char *text;                      // Bytes received for the book and not yet flushed, in order
+    size_t text_len;                 // Bytes stored in text
+    size_t text_cap;                 // Capacity of text
+    size_t text_start;               // First byte of text that belongs in the output file (skips a BOM)
+    size_t text_base;                // Output file offset of text[text_start]
+    int heap_index;                  // Position in rank_heap (guarded by rank_mutex)
+    int ranked_occurrences;          // Occurrences the heap is ordered by (guarded by rank_mutex)
+    int out_fd;                      // Output file while the writer thread has it open, or -1
+    atomic_int written;              // Set once the output file is complete; only then can the book be evicted
+    atomic_int refs;                 // The registry's reference plus one per query reading the book
+    atomic_size_t held_bytes;        // Bytes received for the book and not yet written or dropped (-c, -g)
+    atomic_size_t queued_bytes;      // ... of which the writer thread has been handed
+    uint64_t completed_ns;           // When the book joined the global list (now_ns()), for -T (guarded by list_mutex)
+    size_t retained_bytes;           // Memory the book holds once written, counted against -M (guarded by list_mutex)
+
+    // Index built as lines complete and written next to the output file (owned by the connection's worker).
+    // Unlike the text it is not flushed while streaming: an upload holds 8 bytes per line plus 4 per
+    // match of each term until it ends, so ~100 MB for a 1 GB book of 80-byte lines
+    uint64_t *line_offsets;          // Output file offset of every complete line
+    size_t line_count;
+    size_t line_cap;
+    uint64_t indexed_len;            // End of the last complete line in the output file
+    uint32_t **match_lines;          // Per search term: numbers of the lines it matched, ascending
+    size_t *match_counts;
+    size_t *match_caps;
+
+    // Books loaded from disk at startup keep their files mapped instead
+    char *index_map;                 // The whole sidecar index, or NULL
+    size_t index_map_len;
+    char *text_map;                  // The whole output file, or NULL if it is empty
+    size_t text_map_len;
 } Book;
 
+// Header of a book's sidecar index (book_NN.idx), all fields native-endian. It is followed by
+// one IndexPattern per search term, the uint64_t offset of every line in book_NN.txt, each
+// term's uint32_t match-line numbers (padded to 8 bytes) and finally the terms themselves
+typedef struct IndexHeader {
+    char magic[8];                   // INDEX_MAGIC
+    uint32_t pattern_count;
+    uint32_t reserved;
+    uint64_t text_len;               // Bytes in book_NN.txt
+    uint64_t line_count;
+    uint64_t occurrences;            // Matches of every search term
+} IndexHeader;
+
+// One search term's entry in a sidecar index
+typedef struct IndexPattern {
+    uint64_t occurrences;
+    uint64_t match_count;            // Lines with at least one match
+    uint64_t match_offset;           // Index file offset of the match-line numbers
+    uint64_t term_offset;            // Index file offset of the term's bytes
+    uint64_t term_len;
+} IndexPattern;
+
+// One write for the writer thread: a whole book, or one chunk of a streaming book
+typedef struct WriteJob {
+    Book *book;
+    int whole_book;                  // Write every line in the book's node list instead of a chunk
+    char *buffer;                    // Detached text buffer holding the chunk; freed once written
+    size_t start;                    // The chunk starts at buffer + start
+    size_t len;
+    size_t file_offset;              // Where the chunk goes in the output file
+    int last;                        // The book's file is complete once this job is written
+    struct WriteJob *next;           // Next job in the writer thread's queue
+} WriteJob;
+
+// One line of the ranking report, copied out of the heap
+typedef struct RankEntry {
+    int id;
+    int occurrences;
+    int *pattern_occurrences;        // Per-term snapshot, when there is more than one term
+} RankEntry;
+
+// One shard of the book registry: a chained hash table keyed by book id
+typedef struct RegistryShard {
+    _Alignas(CACHE_LINE_SIZE) pthread_mutex_t lock;
+    Book **buckets;
+    size_t bucket_count;             // Always a power of two
+    size_t size;
+} RegistryShard;
+
+// Aho-Corasick automaton over every search term, compiled once at startup
+typedef struct Automaton {
+    int state_count;
+    int (*next)[256];                // DFA transition for every state and input byte
+    int *output;                     // Deepest state on the suffix chain that ends a pattern, or 0
+    int *output_link;                // Next shorter state on the suffix chain that ends a pattern, or 0
+    int *first_pattern;              // First pattern ending exactly at a state, or -1
+    int *pattern_next;               // Next pattern ending at the same state, or -1
+} Automaton;
+
+// One io_uring instance: the shared submission and completion queues
+typedef struct IoRing {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit;              // Entries queued since the last io_uring_enter()
+    unsigned features;               // IORING_FEAT_* flags the kernel reported
+} IoRing;
+
+// Received bytes sitting in one provided buffer, waiting for a worker
+typedef struct RecvChunk {
+    int len;
+    int next;                        // Next buffer in the same connection's inbox, or -1
+} RecvChunk;
+
+// One queued log message
+typedef struct LogRecord {
+    uint64_t timestamp_ns;           // CLOCK_REALTIME when it was logged
+    int level;
+    int len;                         // Bytes used in text
+    char text[LOG_RECORD_SIZE - 16];
+} LogRecord;
+
+// Messages logged by one thread, waiting for the flusher: a single-producer, single-consumer ring
+typedef struct LogRing {
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t head;  // Next record the owning thread fills
+    atomic_size_t dropped;           // Messages lost to a full ring (written only by the owner)
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t tail;  // Next record the flusher writes out
+    size_t reported_dropped;         // Drops already reported (flusher only)
+    int thread_id;                   // Registration order, shown in every line
+    struct LogRing *next;            // Next ring in log_rings
+    LogRecord records[LOG_RING_RECORDS];
+} LogRing;
+
+// One thread's share of the metrics. Only the owning thread writes it, with plain loads and
+// stores; the endpoint sums every thread's copy, so recording never contends on a cache line
+typedef struct ThreadMetrics {
+    atomic_ulong buckets[METRIC_STAGES][HISTOGRAM_BUCKETS];
+    atomic_ulong sum_ns[METRIC_STAGES];
+    atomic_ulong counters[METRIC_COUNTERS];
+    struct ThreadMetrics *next;      // Next thread's metrics in metrics_threads
+} ThreadMetrics;
+
+// A run of whole lines of one book, matched by whichever worker gets to it first. The worker
+// that split the run fills in the inputs; the task writes only its outputs
+typedef struct MatchTask {
+    const char *text;                // Book text the offsets below are relative to
+    size_t start;                    // Offset of the task's first line
+    const size_t *line_ends;         // Offset just past each line's newline
+    int *line_occurrences;           // Out: matches in each line
+    size_t line_count;
+    size_t first_line;               // Book-wide number of the first line, for metrics sampling
+    int *pattern_occurrences;        // Out: matches of each search term
+    int *line_pattern_occurrences;   // Per-term matches in the line being matched (several terms only)
+    uint32_t *hits;                  // Out: (line within the task, term) pairs, in line order (several terms only)
+    size_t hit_count;
+    size_t hit_cap;
+    atomic_int *remaining;           // Tasks of the run not finished yet
+} MatchTask;
+
+// One worker's tasks (a Chase-Lev deque): the owner pushes and pops at the bottom without
+// contention, idle workers steal the oldest task from the top
+typedef struct TaskDeque {
+    _Alignas(CACHE_LINE_SIZE) atomic_long top;     // Next task a thief takes
+    _Alignas(CACHE_LINE_SIZE) atomic_long bottom;  // Next free slot; written only by the owner
+    _Atomic(MatchTask *) slots[TASK_DEQUE_SIZE];
+} TaskDeque;
+
+// One connection's bytes on their way down the pipeline: the receiver fills data, the splitter
+// cuts it at line boundaries, a matcher fills in match, and the aggregator indexes and frees it
+typedef struct Batch {
+    struct Connection *conn;
+    char *data;
+    size_t len;                      // Bytes in data
+    size_t cap;                      // Capacity of data
+    int last;                        // The stream ended after these bytes
+    size_t lines;                    // Complete lines; a final unterminated line is matched but not indexed
+    size_t *line_ends;               // Offset in data just past each line
+    int *line_occurrences;           // Matches in each line
+    MatchTask match;                 // The batch's lines as one matching task
+} Batch;
+
+// Batches (or, into the writer thread, write jobs) from one pipeline thread to one thread of the
+// next stage: a single-producer, single-consumer ring, so neither side ever takes a lock
+typedef struct StageRing {
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t head;  // Next slot the producer fills
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t tail;  // Next slot the consumer empties
+    struct StageThread *producer;    // Woken when the ring gets room
+    struct StageThread *consumer;    // Woken when the ring gets an item
+    void *slots[PIPELINE_RING_SIZE];
+} StageRing;
+
+// One thread of a pipeline stage. It sleeps on wake_seq (a futex) when all its input rings are
+// empty, or its output ring is full; the timings are written only by the thread itself. A receiver
+// never sleeps there, since it is a reactor serving every other socket too: it parks the connection
+// whose ring is full instead, and sleeping means a splitter should write wake_fd once it makes room
+typedef struct StageThread {
+    int stage;                       // STAGE_*
+    int index;                       // Position within the stage
+    int cpu;                         // Core slot the thread is pinned to, or -1
+    StageRing **inputs;              // One ring from every thread of the previous stage
+    int input_count;
+    int next_input;                  // Input polled first next time, so no producer starves
+    StageRing **outputs;             // One ring to every thread of the next stage
+    _Alignas(CACHE_LINE_SIZE) atomic_uint wake_seq;
+    atomic_int sleeping;             // Set while the thread waits, so the others know to wake it
+    atomic_ulong batches;            // Batches (or write jobs) handled
+    atomic_ulong idle_ns;            // Time waiting for input
+    atomic_ulong blocked_ns;         // Time waiting for room in the next stage's ring (backpressure)
+    int wake_fd;                     // Receivers: eventfd in the reactor's epoll; -1 for the other stages
+    struct Connection *parked;       // Receivers: connections not read until their split ring has room
+    uint64_t parked_since;           // Receivers: when parked last became non-empty
+} StageThread;
+
+// Counts (overlapping) occurrences of one pattern in text
+typedef size_t (*count_kernel_fn)(const char *text, size_t len, const char *pattern, size_t pattern_len);
+
+// One acceptor: a listening socket of its own (SO_REUSEPORT when there are several, so the kernel
+// spreads new connections across them), the epoll reactor that owns it and every socket it accepted,
+// and the ready queue of the share of the worker pool that serves those sockets
+typedef struct Reactor {
+    int index;
+    int listen_fd;
+    int epollfd;
+    int cpu;                             // Core the reactor thread is pinned to, or -1
+    struct Connection *ready_head;       // Connections with readable sockets, oldest first
+    struct Connection *ready_tail;
+    pthread_mutex_t ready_mutex;
+    pthread_cond_t ready_cond;
+    unsigned task_wakes;                 // Times wake_idle_workers() has run (ready_mutex)
+    atomic_int accept_paused;            // Stopped accepting; the next release_connection() re-arms the listener
+} Reactor;
+
+// Per-connection state; owned by at most one worker at a time
+typedef struct Connection {
+    int sockfd;
+    Reactor *reactor;                    // Reactor the socket is registered with
+    int connection_order;
+    Book *book;                          // Reference to the current book
+    size_t line_start;                   // Offset of the incomplete line in book->text
+    size_t scan_pos;                     // Bytes of book->text already searched for newlines
+    size_t match_start;                  // First position the single-term kernel has not tested yet
+    int match_state;                     // Automaton state carried across reads
+    int line_occurrences;                // Matches found so far in the incomplete line
+    int pending_occurrences;             // Matches not yet published to the book's counters
+    int *pending_pattern_occurrences;    // Per-term matches not yet published
+    int *line_pattern_occurrences;       // Per-term matches in the incomplete line, for the index
+    int bom_checked;                     // Start of the stream has been checked for a BOM
+    int query;                           // QUERY_NONE, QUERY_PENDING or QUERY_ANSWERED
+    struct Connection *next_ready;       // Next connection in the ready queue
+
+    // io_uring backend: buffers filled by the reactor, drained by a worker
+    pthread_mutex_t inbox_lock;
+    int inbox_head;                      // First received buffer not yet copied, or -1
+    int inbox_tail;                      // Last received buffer not yet copied, or -1
+    int inbox_closed;                    // Peer closed the stream or the receive failed
+    int scheduled;                       // On the ready queue or being handled by a worker
+    struct Connection *next_starved;     // Next connection whose receive ran out of buffers, or stopped while paused
+    int recv_paused;                     // Over a byte budget: received bytes are spilled, not queued
+    char *spill;                         // Bytes received while paused, copied out so their buffers go back at once
+    size_t spill_len;
+    size_t spill_cap;
+    int recv_cancelling;                 // A cancel of the paused receive is on its way (reactor only)
+
+    // Matching a long run of complete lines in parallel: scratch reused from run to run
+    size_t *run_line_ends;               // Offset just past the newline of every line in the run
+    int *run_line_occurrences;           // Matches in each of those lines
+    size_t run_cap;
+    MatchTask *tasks;                    // The run's tasks, in line order
+    int task_cap;
+
+    // Pipeline: the receiver hands the stream on once it knows it is not a query, and the
+    // splitter keeps the incomplete line until the batch that ends it arrives
+    int pipelined;                       // Batches have gone to the splitter (receiver only)
+    char *carry;                         // Bytes after the last newline seen (splitter only)
+    size_t carry_len;
+    size_t carry_cap;
+    size_t lines_split;                  // Lines cut so far, for sampling the match stage (splitter only)
+
+    // Byte budgets: a connection over one is not read until the writer thread frees some bytes
+    int truncated;                       // io_uring: the upload ended early; the rest of the stream is dropped
+    atomic_int line_too_long;            // Pipeline: the splitter dropped a line longer than the connection budget
+    uint64_t throttled_since;            // When the connection was last parked
+    uint64_t throttled_ns;               // Time spent parked so far
+    struct Connection *next_throttled;   // Next parked connection (guarded by throttle_mutex)
+    struct Connection *next_parked;      // Pipeline: next connection waiting for room in its split ring (receiver only)
+} Connection;
+
 // Global variables
-Book books[MAX_BOOKS];               // Array of books
-Node *global_list_head = NULL;       // Global list for all books
-int book_count = 0;                  // Number of books processed
+RegistryShard registry[REGISTRY_SHARDS];  // Every book in memory, by id
+atomic_int last_book_id;             // Last book id handed out
+Book *global_list_head = NULL;       // Global list of finished books, in completion order
+Book *global_list_tail = NULL;       // Last finished book, for O(1) appends
+int completed_book_count = 0;        // Books in the global list (guarded by list_mutex)
+int max_completed_books = DEFAULT_MAX_COMPLETED_BOOKS;  // Oldest completed books beyond this are evicted; 0 keeps all
+uint64_t max_book_age_ns = 0;        // Completed books older than this are evicted (-T); 0 keeps them
+size_t max_retained_bytes = 0;       // Oldest completed books are evicted while written ones hold more (-M); 0: no cap
+size_t retained_bytes = 0;           // Memory held by the written books in the global list (guarded by list_mutex)
 pthread_mutex_t list_mutex = PTHREAD_MUTEX_INITIALIZER;  // Mutex for thread safety
-char *search_term;  // Global variable for search term
+pthread_mutex_t reclaim_mutex = PTHREAD_MUTEX_INITIALIZER;  // Guards reclaim_pending
+pthread_cond_t reclaim_cond;         // Wakes the reclaimer thread; waits on CLOCK_MONOTONIC deadlines
+int reclaim_pending = 0;             // The writer thread completed books since the reclaimer last looked
+char **search_terms;                 // Every search term given with -p or -f
+int search_term_count = 0;           // Number of search terms
+Automaton automaton;                 // Matcher compiled from the search terms
+size_t search_term_length;           // Length of search_terms[0], for the single-term kernel
+count_kernel_fn count_occurrences;   // Single-term kernel picked for this CPU at startup
+
+// Max-heap of books by occurrences, updated as books are ingested
+Book **rank_heap = NULL;
+int rank_heap_size = 0;
+int rank_heap_capacity = 0;
+pthread_mutex_t rank_mutex = PTHREAD_MUTEX_INITIALIZER;  // Guards the heap; independent of list_mutex
+int report_top_k = 0;                // Books shown per report; 0 shows them all
+
+// Acceptors, each feeding its own share of the worker pool
+Reactor *reactors = NULL;
+int acceptor_count = DEFAULT_ACCEPTORS;
+int listen_backlog = DEFAULT_BACKLOG;
+int connection_limit = INT_MAX;      // Connections open at once, below the descriptor limit; fixed before any thread starts
+atomic_int open_connections;         // Connections created and not yet released
+
+// Work stealing: every worker owns a deque of matching tasks that the others steal from when idle
+TaskDeque *task_deques = NULL;       // One per worker, allocated before the workers start
+int parallel_match = 0;              // Split long runs of lines into tasks: needs spare workers and spare cores
+atomic_int task_deque_count;         // Deques claimed by running workers
+atomic_int queued_tasks;             // Tasks pushed and not yet taken; idle workers sleep while it is 0
+_Thread_local TaskDeque *task_deque = NULL;  // The calling worker's deque
+
+// Pipeline: off unless -P sizes its stages, in which case the reactors read and the stage threads
+// do the rest, connected by a ring between every pair of threads in neighbouring stages
+int pipeline_enabled = 0;            // Fixed before any thread starts
+int stage_sizes[PIPELINE_STAGES];    // Threads in each stage
+StageThread *stage_threads[PIPELINE_STAGES];
+_Thread_local StageThread *stage_thread = NULL;  // The calling thread's place in the pipeline
+
+// Queue of books and chunks waiting for the writer thread
+WriteJob *write_head = NULL;
+WriteJob *write_tail = NULL;
+pthread_mutex_t write_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t write_cond = PTHREAD_COND_INITIALIZER;
+int fsync_policy = FSYNC_NONE;       // One of FSYNC_NONE, FSYNC_BOOK, FSYNC_BATCH
+size_t flush_threshold = 0;          // Stream complete lines to disk once this many are buffered; 0 writes each book at close
+
+// Byte budgets (-c, -g), 0 meaning unlimited. A received byte counts until the writer thread has written
+// it to the book's file (or it is dropped), so whole books waiting for the writer count too
+int budgets_enabled = 0;             // Fixed before any thread starts
+size_t connection_budget = 0;        // Bytes one upload may hold
+size_t global_budget = DEFAULT_GLOBAL_BUDGET;  // Bytes all uploads together may hold, write jobs queued for the writer included
+atomic_size_t total_held_bytes;      // Bytes held by every upload
+atomic_size_t total_queued_bytes;    // ... of which the writer thread has been handed
+Connection *throttled_head = NULL;   // Connections parked by check_budgets(), newest first
+int throttled_count = 0;
+pthread_mutex_t throttle_mutex = PTHREAD_MUTEX_INITIALIZER;  // Guards the parked list
+
+// io_uring backend: one ring for the reactor, one for the writer thread
+int io_backend = IO_BACKEND_EPOLL;   // IO_BACKEND_URING only once both rings are set up
+IoRing reactor_ring;                 // Accepts and receives; submitted to only by the reactor
+IoRing writer_ring;                  // Opens, writes, syncs and closes book files
+struct io_uring_buf_ring *recv_ring; // Free buffers the kernel picks received data into
+char *recv_buffers;                  // RECV_BUFFER_COUNT buffers of RECV_BUFFER_SIZE
+RecvChunk recv_chunks[RECV_BUFFER_COUNT];  // What each buffer currently holds
+pthread_mutex_t recv_ring_mutex = PTHREAD_MUTEX_INITIALIZER;  // Workers return buffers concurrently
+atomic_int recv_buffers_free;        // Buffers currently in recv_ring
+
+// Logger: every thread that logs owns a ring; the flusher thread drains them all to stderr
+int log_level = LOG_INFO;            // Most verbose level kept (-v), fixed before any thread starts
+_Atomic(LogRing *) log_rings = NULL; // Every thread's ring, newest first; rings are never freed
+atomic_int log_thread_count;         // Rings registered so far
+_Thread_local LogRing *log_ring = NULL;  // The calling thread's ring, once it has logged
+pthread_mutex_t log_flush_mutex = PTHREAD_MUTEX_INITIALIZER;  // Serializes consumers; logging threads never take it
+
+// Metrics: off unless -e gives the endpoint a port, in which case every thread records its own share
+int metrics_enabled = 0;             // Fixed before any thread starts
+_Atomic(ThreadMetrics *) metrics_threads = NULL;  // Every recording thread's metrics; never freed
+_Thread_local ThreadMetrics *thread_metrics = NULL;  // The calling thread's metrics, once it has recorded
 
 
 // Function prototypes
 void error(const char *msg);
-void add_node_to_global_list(Node *new_node);
-void add_node_to_book_list(char *data, Node **book_head, const char *search_term, Book *book);
-void write_book_to_file(Node *book_head, int book_number);
-void free_list(Node *book_head);
-void remove_bom(char* buffer);
-void *handle_client(void *newsockfd_ptr);
-void free_global_list(Node* book_head);
-void set_nonblocking(int sockfd);
-void accumulate_line(char *buffer, char *line_buffer, int *line_pos, Node **book_head, const char *search_term, Book *book);
+void add_node_to_global_list(Book *book);
+void add_node_to_book_list(size_t offset, size_t length, int found_occurrences, Book *book);
+int open_book_file(Book *book);
+void write_book_to_file(Book *book, int fd);
+int gather_book_lines(Book *book, Node **cursor, struct iovec *iov, int max);
+size_t write_all(int fd, struct iovec *iov, int iov_count, size_t offset);
+void iov_advance(struct iovec **iov, int *iov_count, size_t n);
+void write_batch(WriteJob **batch, int count);
+void write_batch_uring(WriteJob **batch, int count);
+void complete_job(WriteJob *job);
+void enqueue_write(WriteJob *job);
+void enqueue_book_write(Book *book);
+void flush_complete_lines(Connection *conn, int last);
+char *book_text_at(const Book *book, size_t file_offset);
+void *writer_thread_func(void *arg);
+int parse_fsync_policy(const char *name);
+void *arena_alloc(Arena *arena, size_t size);
+void arena_free(Arena *arena);
+size_t bom_length(const char *buffer, size_t len);
+void handle_client(Connection *conn);
+void rearm_socket(Connection *conn);
+void handle_client_uring(Connection *conn);
+void pause_receive(Connection *conn);
+void copy_recv_buffer(Book *book, int bid);
+void grow_text(Book *book, size_t room);
+void index_received_bytes(Connection *conn, int closed);
+void finish_client(Connection *conn);
+void release_connection(Connection *conn);
+int query_handshake(const char *bytes, size_t len);
+void receive_query(Connection *conn, int closed);
+void answer_query(int sockfd, char *query);
+int send_ranking(int sockfd, int limit);
+int send_matching_lines(int sockfd, Book *book, int pattern);
+int send_all(int sockfd, struct iovec *iov, int iov_count);
+int send_text(int sockfd, const char *text);
+const uint64_t *book_line_offsets(const Book *book);
+const uint32_t *book_match_lines(const Book *book, int pattern, size_t *count);
+const char *book_file_bytes(const Book *book);
+Connection *create_connection(int sockfd, Reactor *reactor);
+void *worker_thread_func(void *arg);
+void schedule_connection(Connection *conn);
+int open_listener(int port, int backlog, int reuseport);
+void *reactor_thread_func(void *arg);
+void run_reactor(Reactor *reactor);
+void pin_to_cpu(int slot);
+void accept_connections(Reactor *reactor);
+void resume_accepting(void);
+void free_global_list(Book *book);
+int parse_io_backend(const char *name);
+int io_ring_init(IoRing *ring, unsigned entries, unsigned flags);
+struct io_uring_sqe *io_ring_sqe(IoRing *ring);
+int io_ring_enter(IoRing *ring, unsigned wait_nr);
+int io_ring_enter_timeout(IoRing *ring, unsigned wait_nr, long timeout_ns);
+struct io_uring_cqe *io_ring_cqe(IoRing *ring);
+void io_ring_cqe_seen(IoRing *ring);
+int io_ring_wait_all(IoRing *ring, int count, int *results);
+int init_io_uring(void);
+void uring_reactor(int sockfd);
+void uring_arm_accept(int sockfd);
+void uring_arm_recv(Connection *conn);
+void deliver_received(Connection *conn, int res, unsigned flags, Connection **starved, Connection **stopped);
+void spill_received(Connection *conn, int bid, size_t len);
+int receive_paused(Connection *conn);
+void recycle_recv_buffer(int bid);
+void accumulate_line(Connection *conn);
+size_t match_lines_parallel(Connection *conn, size_t from);
+void run_match_task(MatchTask *task);
+int task_push(TaskDeque *deque, MatchTask *task);
+MatchTask *task_pop(TaskDeque *deque);
+MatchTask *task_steal(TaskDeque *deque);
+MatchTask *steal_any_task(void);
+void wake_idle_workers(void);
+int match_stream(Connection *conn, size_t from, size_t to);
+void add_search_term(const char *term);
+void load_search_terms(const char *path);
+void build_automaton(Automaton *ac, char **patterns, int pattern_count);
+int count_matches(const Automaton *ac, int *state, const char *text, size_t len, int *pattern_counts, int *line_counts);
+size_t count_occurrences_scalar(const char *text, size_t len, const char *pattern, size_t pattern_len);
+#if defined(__x86_64__) || defined(__i386__)
+size_t count_occurrences_sse2(const char *text, size_t len, const char *pattern, size_t pattern_len);
+size_t count_occurrences_avx2(const char *text, size_t len, const char *pattern, size_t pattern_len);
+#endif
+count_kernel_fn select_count_kernel(void);
+void publish_occurrences(Connection *conn);
+void snapshot_occurrences(Book *book, int *occurrences, int *pattern_occurrences);
+void init_registry(void);
+Book *create_book(void);
+Book *create_book_with_id(int id);
+void index_add_line(Book *book, uint64_t offset, uint64_t length);
+void index_add_match(Book *book, int pattern, uint32_t line);
+void write_book_index(Book *book);
+int load_book_store(void);
+int load_book(int id);
+int index_is_valid(const char *index_map, size_t index_len);
+int compare_ids(const void *a, const void *b);
+void free_book(Book *book);
+void register_book(Book *book);
+void unregister_book(Book *book);
+Book *registry_lookup_locked(RegistryShard *shard, unsigned hash, int id);
+Book *acquire_book(int id);
+void release_book(Book *book);
+uint64_t evict_completed_books(void);
+int retention_exceeded(const Book *oldest, uint64_t now);
+size_t book_resident_bytes(const Book *book);
+void wake_reclaimer(void);
+void *reclaimer_thread_func(void *arg);
+void add_book_to_ranking(Book *book);
+void remove_book_from_ranking(Book *book);
+void update_ranking(Book *book);
+int ranks_before(const Book *a, const Book *b);
+void rank_heap_swap(int i, int j);
+void rank_heap_sift_up(int i);
+void rank_heap_sift_down(int i);
+int collect_top_books(RankEntry *entries, int limit);
 void print_sorted_books();
 void *analysis_thread_func(void *arg);
+void log_write(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+LogRing *log_register_thread(void);
+int log_flush(void);
+size_t log_format_line(char *out, uint64_t timestamp_ns, int level, int thread_id, const char *text, int len);
+void log_output(const char *out, size_t len);
+void *log_thread_func(void *arg);
+int parse_log_level(const char *name);
+uint64_t now_ns(void);
+ThreadMetrics *metrics_for_thread(void);
+uint64_t metrics_start(void);
+void metrics_stop(int stage, uint64_t start);
+void metrics_record(int stage, uint64_t ns);
+void metrics_count(int counter, uint64_t n);
+int histogram_bucket(uint64_t ns);
+uint64_t histogram_bucket_bound(int bucket);
+int open_metrics_listener(int port);
+void *metrics_thread_func(void *arg);
+char *format_metrics(size_t *len);
+int parse_pipeline_sizes(const char *spec);
+void start_pipeline(void);
+void *stage_thread_func(void *arg);
+int stage_route(const Connection *conn, int stage);
+void stage_send(StageThread *self, int to, void *item);
+void *stage_poll(StageThread *self);
+void *stage_receive(StageThread *self);
+int stage_ready(StageThread *self, StageRing *full);
+void stage_wait(StageThread *self, StageRing *full);
+void stage_wake(StageThread *thread);
+void stage_count(atomic_ulong *value, uint64_t n);
+int split_ring_has_room(Connection *conn);
+void park_connection(Connection *conn);
+void resume_parked(StageThread *self);
+int peek_handshake(Connection *conn, int *closed);
+void receive_query_bytes(Connection *conn);
+void receive_batches(Connection *conn);
+Batch *create_batch(Connection *conn);
+void free_batch(Batch *batch);
+int split_batch(Batch *batch);
+void carry_bytes(Connection *conn, const char *bytes, size_t len);
+void aggregate_batch(Batch *batch);
+void index_task_lines(Connection *conn, MatchTask *task, size_t lines, uint64_t offset);
+int take_write_jobs(WriteJob **batch);
+void charge_bytes(Book *book, size_t n);
+void queue_bytes(const WriteJob *job);
+void release_bytes(Book *book, size_t held, size_t queued);
+int over_budget(Book *book);
+int must_wait(Book *book);
+int check_budgets(Connection *conn);
+int line_over_budget(Connection *conn);
+void truncate_upload(Connection *conn);
+void resume_throttled(void);
+void limit_carry(Connection *conn);
 
 int main(int argc, char *argv[]) {
-    int sockfd, newsockfd, portno;
-    socklen_t clilen;
-    struct sockaddr_in serv_addr, cli_addr;
-    pthread_t thread_id, analysis_thread_id;  // Thread identifiers
+    int portno = -1, metrics_port = -1;
+    int worker_threads = DEFAULT_WORKER_THREADS;
+    pthread_t thread_id, analysis_thread_id, writer_thread_id, reclaimer_thread_id, log_thread_id, metrics_thread_id;  // Thread identifiers
+    int opt;
+
+    // Parse command-line arguments
+    while ((opt = getopt(argc, argv, "l:p:f:t:k:m:T:M:s:i:w:v:e:a:b:P:c:g:")) != -1) {
+        switch (opt) {
+        case 'l':
+            portno = atoi(optarg);        // Extract port number from the -l flag
+            break;
+        case 'p':
+            add_search_term(optarg);      // Each -p flag adds one search term
+            break;
+        case 'f':
+            load_search_terms(optarg);    // Read one search term per line from a file
+            break;
+        case 't':
+            worker_threads = atoi(optarg);  // Extract worker pool size from the -t flag
+            break;
+        case 'k':
+            report_top_k = atoi(optarg);  // Extract report length from the -k flag
+            break;
+        case 'm':
+            max_completed_books = atoi(optarg);  // Extract the completed-book cap from the -m flag
+            break;
+        case 'T':
+            max_book_age_ns = strtoul(optarg, NULL, 10) * 1000000000ull;  // Extract the retention time in seconds from the -T flag
+            break;
+        case 'M':
+            max_retained_bytes = strtoul(optarg, NULL, 10);  // Extract the retained-memory cap from the -M flag
+            break;
+        case 's':
+            fsync_policy = parse_fsync_policy(optarg);  // Extract the fsync policy from the -s flag
+            break;
+        case 'i':
+            io_backend = parse_io_backend(optarg);  // Extract the I/O backend from the -i flag
+            break;
+        case 'w':
+            flush_threshold = strtoul(optarg, NULL, 10);  // Extract the streaming flush threshold from the -w flag
+            break;
+        case 'v':
+            log_level = parse_log_level(optarg);  // Extract the log level from the -v flag
+            break;
+        case 'e':
+            metrics_port = atoi(optarg);  // Extract the metrics endpoint port from the -e flag
+            metrics_enabled = 1;
+            break;
+        case 'a':
+            acceptor_count = atoi(optarg);  // Extract the number of acceptors from the -a flag
+            break;
+        case 'b':
+            listen_backlog = atoi(optarg);  // Extract the listen backlog from the -b flag
+            break;
+        case 'P':
+            pipeline_enabled = parse_pipeline_sizes(optarg);  // Extract the pipeline stage sizes from the -P flag
+            break;
+        case 'c':
+            connection_budget = strtoul(optarg, NULL, 10);  // Extract the per-connection byte budget from the -c flag
+            break;
+        case 'g':
+            global_budget = strtoul(optarg, NULL, 10);  // Extract the global byte budget from the -g flag
+            break;
+        default:
+            portno = -1;
+            break;
+        }
+    }
 
     // Validate command-line arguments
-    if (argc != 5 || strcmp(argv[1], "-l") != 0 || strcmp(argv[3], "-p") != 0) {
-        fprintf(stderr, "ERROR: Invalid arguments\nUsage: ./server5 -l <port> -p <search_term>\n");
+    if (portno < 0 || search_term_count == 0 || worker_threads < 1 || report_top_k < 0 || max_completed_books < 0 || fsync_policy < 0 || io_backend < 0 || log_level < 0 || (metrics_enabled && metrics_port < 0) || acceptor_count < 1 || listen_backlog < 1 || pipeline_enabled < 0 || optind != argc) {
+        fprintf(stderr, "ERROR: Invalid arguments\nUsage: ./server5 -l <port> -p <search_term> [-p <search_term>...] [-f <pattern_file>] [-t <worker_threads>] [-k <top_k>] [-m <max_completed_books>] [-T <max_book_age_seconds>] [-M <max_retained_bytes>] [-s none|book|batch] [-i epoll|uring] [-w <flush_bytes>] [-v error|warn|info|debug|trace] [-e <metrics_port>] [-a <acceptors>] [-b <backlog>] [-P <splitters>,<matchers>,<aggregators>] [-c <connection_budget_bytes>] [-g <global_budget_bytes>]\n");
         exit(1);
     }
 
-    // Extract port number and search term from the command line
-    portno = atoi(argv[2]);        // Extract port number from the -l flag
-    search_term = argv[4];         // Extract search term from the -p flag
+    // Start the log flusher first; messages logged before it runs simply wait in their rings
+    pthread_create(&log_thread_id, NULL, log_thread_func, NULL);
+    pthread_detach(log_thread_id);
 
-    printf("Starting server on port %d with search term: %s\n", portno, search_term);
+    // Compile every search term into one automaton so each line is scanned once;
+    // a single term uses the SIMD counting kernel instead
+    build_automaton(&automaton, search_terms, search_term_count);
+    search_term_length = strlen(search_terms[0]);
+    count_occurrences = select_count_kernel();
+    init_registry();
+    load_book_store();  // Books ingested by earlier runs; new ids continue after theirs
 
-    // Create socket
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0)
-        error("ERROR opening socket");
+    if (search_term_count == 1) {
+        LOG(LOG_INFO, "Starting server on port %d with search term: %s (%d worker threads)", portno, search_terms[0], worker_threads);
+    } else {
+        LOG(LOG_INFO, "Starting server on port %d with %d search terms (%d worker threads)", portno, search_term_count, worker_threads);
+    }
 
-    // Initialize server address structure
-    memset((char *)&serv_addr, 0, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = INADDR_ANY;
-    serv_addr.sin_port = htons(portno);  // Correctly use the extracted port number here
+    budgets_enabled = connection_budget > 0 || global_budget > 0;
+    if (budgets_enabled) {
+        LOG(LOG_INFO, "Byte budgets: %zu per connection, %zu in total (0: unlimited)", connection_budget, global_budget);
+    }
+    if (max_book_age_ns > 0 || max_retained_bytes > 0) {
+        LOG(LOG_INFO, "Retention: %d books, %llu s, %zu bytes (0: unlimited)", max_completed_books,
+            (unsigned long long)(max_book_age_ns / 1000000000), max_retained_bytes);
+    }
 
-    // Bind the socket to the port
-    if (bind(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
-        error("ERROR on binding");
+    // A query client that disconnects mid-reply fails the send instead of killing the server
+    signal(SIGPIPE, SIG_IGN);
 
-    // Start listening for incoming connections
-    listen(sockfd, 5);
-    clilen = sizeof(cli_addr);
+    // The pipeline's receive stage is the epoll reactors, which read the sockets themselves
+    if (pipeline_enabled && io_backend == IO_BACKEND_URING) {
+        LOG(LOG_WARN, "Pipeline uses the epoll backend, not io_uring");
+        io_backend = IO_BACKEND_EPOLL;
+    }
+
+    // Set up io_uring before any thread starts, so every thread agrees on the backend
+    if (io_backend == IO_BACKEND_URING && init_io_uring() < 0) {
+        LOG(LOG_WARN, "io_uring unavailable, falling back to epoll: %m");
+        io_backend = IO_BACKEND_EPOLL;
+    }
+    LOG(LOG_INFO, "I/O backend: %s", io_backend == IO_BACKEND_URING ? "io_uring" : "epoll");
+
+    // The io_uring reactor submits to a single ring, so it keeps a single acceptor
+    if (io_backend == IO_BACKEND_URING && acceptor_count > 1) {
+        LOG(LOG_WARN, "io_uring backend uses one acceptor, not %d", acceptor_count);
+        acceptor_count = 1;
+    }
+    // Every acceptor needs at least one worker of its own (the pipeline has no worker pool)
+    if (!pipeline_enabled && worker_threads < acceptor_count) {
+        LOG(LOG_WARN, "Raising the worker pool from %d to %d threads, one per acceptor", worker_threads, acceptor_count);
+        worker_threads = acceptor_count;
+    }
+
+    // Each worker's deque of matching tasks, zeroed (empty) before any worker can steal from it
+    task_deques = aligned_alloc(CACHE_LINE_SIZE, worker_threads * sizeof(TaskDeque));
+    if (task_deques == NULL) {
+        error("ERROR allocating task deques");
+    }
+    memset(task_deques, 0, worker_threads * sizeof(TaskDeque));
+
+    // On a single core the tasks would only take turns, so books are matched inline as before
+    cpu_set_t allowed;
+    int cpus = sched_getaffinity(0, sizeof(allowed), &allowed) == 0 ? CPU_COUNT(&allowed) : 1;
+    parallel_match = worker_threads > 1 && cpus > 1;
+    LOG(LOG_DEBUG, "Parallel matching %s (%d workers, %d cores)", parallel_match ? "on" : "off", worker_threads, cpus);
+
+    // Bind every listening socket before any reactor runs, so a port already in use fails at startup
+    reactors = calloc(acceptor_count, sizeof(Reactor));
+    if (reactors == NULL) {
+        error("ERROR allocating reactors");
+    }
+    for (int i = 0; i < acceptor_count; i++) {
+        reactors[i].index = i;
+        reactors[i].listen_fd = open_listener(portno, listen_backlog, acceptor_count > 1);
+        reactors[i].epollfd = -1;
+        reactors[i].cpu = -1;
+        pthread_mutex_init(&reactors[i].ready_mutex, NULL);
+        pthread_cond_init(&reactors[i].ready_cond, NULL);
+    }
+    LOG(LOG_INFO, "%d acceptor%s, listen backlog %d", acceptor_count, acceptor_count > 1 ? "s" : "", listen_backlog);
+
+    // Connections beyond the descriptor limit wait in the backlog, so a book file can always be opened.
+    // Each one holds its socket and, once its book streams to disk, the book's output file
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < (rlim_t)INT_MAX) {
+        connection_limit = files.rlim_cur > 2 * FD_RESERVE ? ((int)files.rlim_cur - FD_RESERVE) / 2 : (int)files.rlim_cur / 4;
+    }
+    LOG(LOG_INFO, "At most %d connections open at once", connection_limit);
+
+    // Serve the metrics on their own port, bound to the loopback interface only
+    if (metrics_enabled) {
+        int metrics_fd = open_metrics_listener(metrics_port);
+        pthread_create(&metrics_thread_id, NULL, metrics_thread_func, (void *)(long)metrics_fd);
+        pthread_detach(metrics_thread_id);
+        LOG(LOG_INFO, "Metrics on http://127.0.0.1:%d/metrics", metrics_port);
+    }
 
     // Create the analysis thread to periodically print results
     pthread_create(&analysis_thread_id, NULL, analysis_thread_func, NULL);
     pthread_detach(analysis_thread_id);
 
-    // Accept connections and create client threads
-    while (1) {
-        newsockfd = accept(sockfd, (struct sockaddr *)&cli_addr, &clilen);
-        if (newsockfd < 0)
-            error("ERROR on accept");
+    // Wire up the pipeline's rings and start its split, match and aggregate threads
+    if (pipeline_enabled) {
+        start_pipeline();
+    }
 
-        // Set the accepted socket to non-blocking mode
-        set_nonblocking(newsockfd);
+    // Create the writer thread that writes finished books to disk off the workers' path;
+    // in the pipeline it is the persist stage
+    pthread_create(&writer_thread_id, NULL, writer_thread_func, pipeline_enabled ? &stage_threads[STAGE_PERSIST][0] : NULL);
+    pthread_detach(writer_thread_id);
 
-        // Allocate memory for socket pointer and connection order
-        int *params = malloc(3 * sizeof(int));  // Allocate extra space for socket and connection order
-        if (params == NULL) {
-            error("ERROR allocating memory for socket pointer and order");
-        }
-        params[0] = newsockfd;         // First element is the socket
-        params[1] = ++book_count;      // Second element is the connection order
+    // Create the reclaimer thread that evicts old books once they are on disk; its deadlines for -T
+    // are monotonic, like now_ns()
+    pthread_condattr_t reclaim_attr;
+    pthread_condattr_init(&reclaim_attr);
+    pthread_condattr_setclock(&reclaim_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&reclaim_cond, &reclaim_attr);
+    pthread_condattr_destroy(&reclaim_attr);
+    pthread_create(&reclaimer_thread_id, NULL, reclaimer_thread_func, NULL);
+    pthread_detach(reclaimer_thread_id);
 
-        // Create a new thread for each client
-        if (pthread_create(&thread_id, NULL, handle_client, (void *)params) < 0) {
+    // Create the worker pool that reads and indexes sockets handed over by the reactors;
+    // worker i serves acceptor i % acceptor_count
+    for (int i = 0; !pipeline_enabled && i < worker_threads; i++) {
+        if (pthread_create(&thread_id, NULL, worker_thread_func, &reactors[i % acceptor_count]) != 0) {
             error("ERROR creating thread");
         }
+        pthread_detach(thread_id);
+    }
+
+    // With io_uring the reactor waits for completions instead of readiness; it never returns
+    if (io_backend == IO_BACKEND_URING) {
+        uring_reactor(reactors[0].listen_fd);
+    }
 
-        pthread_detach(thread_id);  // Detach the thread to avoid memory leaks
+    // Several acceptors each get a core of their own; the main thread runs the first one
+    for (int i = 1; i < acceptor_count; i++) {
+        reactors[i].cpu = pipeline_enabled ? stage_threads[STAGE_RECEIVE][i].cpu : i;
+        if (pthread_create(&thread_id, NULL, reactor_thread_func, &reactors[i]) != 0) {
+            error("ERROR creating thread");
+        }
+        pthread_detach(thread_id);
+    }
+    if (pipeline_enabled) {
+        reactors[0].cpu = stage_threads[STAGE_RECEIVE][0].cpu;
+    } else if (acceptor_count > 1) {
+        reactors[0].cpu = 0;
     }
+    run_reactor(&reactors[0]);
 
     // Close the socket and free global list
     free_global_list(global_list_head);
-    close(sockfd);
+    close(reactors[0].listen_fd);
     return 0;
 }
 
 
-// Set a socket to non-blocking mode
-void set_nonblocking(int sockfd) {
-    int flags = fcntl(sockfd, F_GETFL, 0);
-    if (flags == -1) {
-        error("ERROR getting socket flags");
-    }
-    if (fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) == -1) {
-        error("ERROR setting non-blocking mode");
-    }
-}
+// Bind a non-blocking listening socket to the port on every interface
+int open_listener(int port, int backlog, int reuseport) {
+    struct sockaddr_in serv_addr;
+    int one = 1;
 
-void *handle_client(void *params) {
-    int *int_params = (int *)params;
-    int newsockfd = int_params[0];  // Extract socket
-    int connection_order = int_params[1];  // Extract connection order
-    free(params);  // Free the allocated memory
+    // Create socket
+    int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);  // The reactor accepts until EAGAIN
+    if (sockfd < 0)
+        error("ERROR opening socket");
 
-    
+    // Acceptors share the port; the kernel hashes each new connection to one of their sockets
+    if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+        error("ERROR setting SO_REUSEPORT");
 
-    char buffer[BUFFER_SIZE];
-    char line_buffer[LINE_BUFFER_SIZE] = {0};  // Buffer to accumulate a full line
-    int line_pos = 0;  // Position within the line buffer
-    int n;
-    Node *book_head = NULL;  // Each thread has its own book-specific list
-    Book *current_book = &books[connection_order - 1];  // Reference to the current book
+    // Initialize server address structure
+    memset((char *)&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = INADDR_ANY;
+    serv_addr.sin_port = htons(port);
 
+    // Bind the socket to the port
+    if (bind(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+        error("ERROR on binding");
 
-    // Non-blocking read loop
-    while (1) {
-        n = read(newsockfd, buffer, BUFFER_SIZE - 1);
+    // Start listening for incoming connections
+    if (listen(sockfd, backlog) < 0)
+        error("ERROR on listen");
+    return sockfd;
+}
 
-        if (n > 0) {
-            buffer[n] = '\0';  // Null-terminate the string
+void *reactor_thread_func(void *arg) {
+    run_reactor((Reactor *)arg);
+    return NULL;
+}
 
-            // Remove BOM if present
-            remove_bom(buffer);
+// Event loop of one acceptor: accept new connections and hand ready ones to its workers
+void run_reactor(Reactor *reactor) {
+    struct epoll_event ev, events[MAX_EVENTS];
 
-            // Accumulate line data until we encounter a newline
-            accumulate_line(buffer, line_buffer, &line_pos, &book_head, search_term, current_book);
-        } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-            usleep(1000);  // Sleep briefly before trying again
-            continue;
-        } else {
-            break;  // Connection closed or error
-        }
+    if (reactor->cpu >= 0) {
+        pin_to_cpu(reactor->cpu);
     }
-
-    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-        error("ERROR reading from socket");
+    if (pipeline_enabled) {
+        stage_thread = &stage_threads[STAGE_RECEIVE][reactor->index];  // The reactor is the receive stage
     }
 
-    // Add the entire book list to the global list
-    pthread_mutex_lock(&list_mutex);  // Lock the mutex before modifying the global list
-    add_node_to_global_list(book_head);
-    pthread_mutex_unlock(&list_mutex);  // Unlock the mutex
+    // The reactor owns its listening socket and every client socket accepted from it
+    reactor->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor->epollfd < 0)
+        error("ERROR creating epoll instance");
 
-    // Write the book-specific list to a file, using connection order for file naming
-    write_book_to_file(book_head, connection_order);
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;  // NULL marks the listening socket
+    if (epoll_ctl(reactor->epollfd, EPOLL_CTL_ADD, reactor->listen_fd, &ev) < 0)
+        error("ERROR adding listening socket to epoll");
 
-    // Close the socket
-    close(newsockfd);
+    // A receiver also hears from the splitters when a parked connection's ring gets room
+    if (stage_thread != NULL) {
+        ev.events = EPOLLIN;
+        ev.data.ptr = stage_thread;
+        if (epoll_ctl(reactor->epollfd, EPOLL_CTL_ADD, stage_thread->wake_fd, &ev) < 0)
+            error("ERROR adding pipeline wakeup to epoll");
+    }
 
-    return NULL;
+    while (1) {
+        uint64_t idle = stage_thread != NULL ? now_ns() : 0;
+        int nfds = epoll_wait(reactor->epollfd, events, MAX_EVENTS, -1);
+        if (nfds < 0) {
+            if (errno == EINTR)
+                continue;
+            error("ERROR on epoll_wait");
+        }
+        if (stage_thread != NULL) {
+            atomic_store_explicit(&stage_thread->idle_ns, atomic_load_explicit(&stage_thread->idle_ns, memory_order_relaxed) +
+                                  (now_ns() - idle), memory_order_relaxed);
+        }
+
+        for (int i = 0; i < nfds; i++) {
+            if (events[i].data.ptr == NULL) {
+                accept_connections(reactor);
+            } else if (pipeline_enabled && events[i].data.ptr == stage_thread) {
+                uint64_t count;
+                if (read(stage_thread->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                    error("ERROR reading pipeline wakeup");
+            } else if (pipeline_enabled) {
+                TSAN_ACQUIRE(events[i].data.ptr);  // The writer thread may have re-armed it
+                receive_batches((Connection *)events[i].data.ptr);  // Read here and pass the bytes down the pipeline
+            } else {
+                TSAN_ACQUIRE(events[i].data.ptr);  // A worker may have re-armed it
+                schedule_connection((Connection *)events[i].data.ptr);
+            }
+        }
+        if (stage_thread != NULL && stage_thread->parked != NULL) {
+            resume_parked(stage_thread);
+        }
+    }
+}
+
+// Pin the calling thread to one of the cores the process may run on, counting from the first
+void pin_to_cpu(int slot) {
+    cpu_set_t allowed, target;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0 || CPU_COUNT(&allowed) == 0) {
+        LOG(LOG_WARN, "Not pinning thread: %m");
+        return;
+    }
+    slot %= CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && slot-- == 0) {
+            CPU_ZERO(&target);
+            CPU_SET(cpu, &target);
+            int err = pthread_setaffinity_np(pthread_self(), sizeof(target), &target);
+            if (err != 0) {
+                errno = err;
+                LOG(LOG_WARN, "Not pinning thread to CPU %d: %m", cpu);
+            } else {
+                LOG(LOG_DEBUG, "Thread pinned to CPU %d", cpu);
+            }
+            return;
+        }
+    }
 }
 
+// Accept every pending connection and register it with the reactor. At the connection limit, or
+// out of descriptors or memory, the rest stay in the backlog until a connection is released
+void accept_connections(Reactor *reactor) {
+    struct epoll_event ev;
 
-void accumulate_line(char *buffer, char *line_buffer, int *line_pos, Node **book_head, const char *search_term, Book *book) {
-    for (int i = 0; buffer[i] != '\0'; i++) {
-        if (buffer[i] == '\n') {
-            // Newline encountered, complete the line
-            line_buffer[*line_pos] = '\0';  // Null-terminate the line
-            strcat(line_buffer, "\n");  // Add the newline character to the line
-            add_node_to_book_list(line_buffer, book_head, search_term, book);  // Pass the search term and current book
-            *line_pos = 0;  // Reset the line position for the next line
-        } else {
-            // Add character to the line buffer
-            line_buffer[*line_pos] = buffer[i];
-            (*line_pos)++;
-            // Avoid overflow
-            if (*line_pos >= LINE_BUFFER_SIZE - 1) {
-                line_buffer[LINE_BUFFER_SIZE - 1] = '\0';  // Null-terminate in case of overflow
-                strcat(line_buffer, "\n");  // Add the newline character
-                *line_pos = 0;
-                add_node_to_book_list(line_buffer, book_head, search_term, book);  // Pass the search term and current book
+    while (1) {
+        // Pause before looking again: a release that missed the flag has already lowered the count
+        if (atomic_load(&open_connections) >= connection_limit) {
+            if (!atomic_exchange(&reactor->accept_paused, 1))
+                LOG(LOG_INFO, "%d connections open, not accepting more until one closes", connection_limit);
+            if (atomic_load(&open_connections) >= connection_limit)
+                return;
+        }
+        uint64_t start = metrics_start();
+        // Accepted sockets come out non-blocking, without a separate fcntl() each
+        int newsockfd = accept4(reactor->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (newsockfd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;  // No more pending connections
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                // Try once more after pausing, in case a connection was released in between
+                if (atomic_exchange(&reactor->accept_paused, 1))
+                    return;
+                LOG(LOG_WARN, "ERROR on accept, not accepting more until a connection closes: %m");
+                continue;
             }
+            if (errno == EBADF || errno == EINVAL || errno == ENOTSOCK || errno == EOPNOTSUPP)
+                error("ERROR on accept");  // The listening socket itself is broken
+            if (errno != EINTR && errno != ECONNABORTED)
+                LOG(LOG_WARN, "ERROR on accept: %m");  // Only this connection failed (EPROTO, EPERM, ...)
+            continue;
         }
+        if (atomic_load_explicit(&reactor->accept_paused, memory_order_relaxed))
+            atomic_store(&reactor->accept_paused, 0);
+
+        Connection *conn = create_connection(newsockfd, reactor);
+
+        // One-shot: the worker that handles an event re-arms the socket when it is done
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+        ev.data.ptr = conn;
+        if (epoll_ctl(reactor->epollfd, EPOLL_CTL_ADD, newsockfd, &ev) < 0)
+            error("ERROR adding client socket to epoll");
+        metrics_stop(METRIC_ACCEPT, start);
+        metrics_count(COUNTER_ACCEPTED, 1);
     }
 }
 
-void add_node_to_book_list(char *data, Node **book_head, const char *search_term, Book *book) {
-    // Create a new node
-    Node *new_node = (Node *)malloc(sizeof(Node));
-    if (new_node == NULL) {
-        error("ERROR allocating memory for new node");
+// Allocate the state of a newly accepted connection and the book it uploads
+Connection *create_connection(int sockfd, Reactor *reactor) {
+    Connection *conn = calloc(1, sizeof(Connection));
+    if (conn == NULL) {
+        error("ERROR allocating memory for connection");
     }
-    new_node->data = strdup(data);  // Duplicate the line of text
-    if (new_node->data == NULL) {
-        free(new_node);
-        error("ERROR duplicating string");
+    conn->sockfd = sockfd;
+    conn->reactor = reactor;
+    conn->book = create_book();
+    atomic_fetch_add(&open_connections, 1);
+    conn->connection_order = conn->book->id;  // Connection order names the output file
+    conn->pending_pattern_occurrences = calloc(search_term_count, sizeof(int));
+    conn->line_pattern_occurrences = calloc(search_term_count, sizeof(int));
+    if (conn->pending_pattern_occurrences == NULL || conn->line_pattern_occurrences == NULL) {
+        error("ERROR allocating pattern counters");
     }
-    new_node->next = NULL;
-    new_node->book_next = NULL;
-    new_node->next_frequent_search = NULL;
+    pthread_mutex_init(&conn->inbox_lock, NULL);
+    conn->inbox_head = conn->inbox_tail = -1;
+    return conn;
+}
 
-    // Add to the book-specific list (this tracks all nodes in the book)
-    if (*book_head == NULL) {
-        *book_head = new_node;
-    } else {
-        Node *book_temp = *book_head;
-        while (book_temp->book_next != NULL) {
-            book_temp = book_temp->book_next;
+// A connection was just released: re-arm every listener that stopped accepting, so epoll reports
+// the connections waiting in its backlog again. The io_uring reactor watches open_connections itself
+void resume_accepting(void) {
+    for (int i = 0; reactors != NULL && i < acceptor_count; i++) {
+        if (atomic_load(&reactors[i].accept_paused) && atomic_exchange(&reactors[i].accept_paused, 0)) {
+            struct epoll_event ev;
+            ev.events = EPOLLIN | EPOLLET;
+            ev.data.ptr = NULL;
+            if (epoll_ctl(reactors[i].epollfd, EPOLL_CTL_MOD, reactors[i].listen_fd, &ev) < 0)
+                error("ERROR re-arming listening socket");
+            LOG(LOG_DEBUG, "Accepting connections again");
         }
-        book_temp->book_next = new_node;
     }
+}
 
-    // Count occurrences of the search pattern in this line
-    const char *temp_str = data;
-    int found_occurrences = 0;
-    while ((temp_str = strstr(temp_str, search_term)) != NULL) {
-        found_occurrences++;
-        temp_str++;  // Move past the found pattern to continue searching
+// Put a connection on its reactor's ready queue and wake one of that reactor's workers
+void schedule_connection(Connection *conn) {
+    Reactor *reactor = conn->reactor;
+    pthread_mutex_lock(&reactor->ready_mutex);
+    conn->next_ready = NULL;
+    if (reactor->ready_tail == NULL) {
+        reactor->ready_head = conn;
+    } else {
+        reactor->ready_tail->next_ready = conn;
     }
+    reactor->ready_tail = conn;
+    pthread_cond_signal(&reactor->ready_cond);
+    pthread_mutex_unlock(&reactor->ready_mutex);
+}
 
-    // Update the book's total occurrences
-    book->occurrences += found_occurrences;
+void *worker_thread_func(void *arg) {
+    Reactor *reactor = (Reactor *)arg;  // The acceptor whose connections this worker serves
+    task_deque = &task_deques[atomic_fetch_add(&task_deque_count, 1)];
+    int failed_steals = 0;               // Passes in a row that found queued tasks but could not take one
+    unsigned seen_wakes = 0;
+    while (1) {
+        // Tasks that stay queued are ones their owners are taking back or other thieves are winning;
+        // after a few tries, sleep until more are queued rather than spin on the count
+        pthread_mutex_lock(&reactor->ready_mutex);
+        while (reactor->ready_head == NULL &&
+               (atomic_load(&queued_tasks) == 0 || (failed_steals >= STEAL_SPINS && reactor->task_wakes == seen_wakes))) {
+            pthread_cond_wait(&reactor->ready_cond, &reactor->ready_mutex);
+        }
+        Connection *conn = reactor->ready_head;
+        if (conn == NULL) {
+            // No socket of our own is ready: help match another worker's book
+            seen_wakes = reactor->task_wakes;
+            pthread_mutex_unlock(&reactor->ready_mutex);
+            MatchTask *task;
+            int stolen = 0;
+            while ((task = steal_any_task()) != NULL) {
+                run_match_task(task);
+                metrics_count(COUNTER_TASKS_STOLEN, 1);
+                stolen = 1;
+            }
+            if (stolen) {
+                failed_steals = 0;
+            } else if (++failed_steals < STEAL_SPINS) {
+                sched_yield();
+            }
+            continue;
+        }
+        failed_steals = 0;
+        reactor->ready_head = conn->next_ready;
+        if (reactor->ready_head == NULL) {
+            reactor->ready_tail = NULL;
+        }
+        pthread_mutex_unlock(&reactor->ready_mutex);
 
-    // If the line contains the search pattern, add it to the frequent search list
-    if (found_occurrences > 0) {
-        if (book->frequent_search_head == NULL) {
-            book->frequent_search_head = new_node;
+        if (io_backend == IO_BACKEND_URING) {
+            handle_client_uring(conn);
         } else {
-            Node *temp = book->frequent_search_head;
-            while (temp->next_frequent_search != NULL) {
-                temp = temp->next_frequent_search;
-            }
-            temp->next_frequent_search = new_node;
+            handle_client(conn);
         }
     }
-
-    printf("Added node: %s", new_node->data);
+    return NULL;
 }
 
-void print_sorted_books() {
-    printf("Books sorted by occurrences:\n");
+// Read a ready socket straight into the book's text buffer and index the new lines
+void handle_client(Connection *conn) {
+    Book *book = conn->book;
+    size_t budget = READ_BUDGET;
+    int closed = 0;
+    ssize_t n;
 
-    int printed_books[book_count];  // Array to track which books have already been printed
-    memset(printed_books, 0, sizeof(printed_books));  // Initialize it to zero (not printed)
+    // Over a byte budget the socket is left unread, so TCP pushes back on the client
+    int allowed = check_budgets(conn);
+    if (allowed == BUDGET_THROTTLED) {
+        return;  // resume_throttled() re-arms the socket
+    }
+    if (allowed == BUDGET_EXCEEDED) {
+        LOG(LOG_WARN, "Ending book_%02d early: a line is longer than the %zu-byte connection budget", book->id, connection_budget);
+        finish_client(conn);
+        return;
+    }
 
-    for (int i = 0; i < book_count; i++) {
-        int max_index = -1;
-        int max_occurrences = -1;
+    while (budget > 0) {
+        // Grow the text buffer so every byte lands in its final home on the first copy
+        grow_text(book, BUFFER_SIZE);
 
-        // Find the book with the maximum occurrences that hasn't been printed yet
-        for (int j = 0; j < book_count; j++) {
-            if (!printed_books[j] && books[j].occurrences > max_occurrences) {
-                max_occurrences = books[j].occurrences;
-                max_index = j;
-            }
+        size_t room = book->text_cap - book->text_len;
+        uint64_t start = metrics_start();
+        n = read(conn->sockfd, book->text + book->text_len, room < budget ? room : budget);
+        metrics_stop(METRIC_READ, start);
+        if (n > 0) {
+            book->text_len += n;
+            budget -= n;
+            charge_bytes(book, n);
+            metrics_count(COUNTER_BYTES_RECEIVED, n);
+            continue;
         }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;  // Socket drained, wait for the next edge
+
+        if (n < 0)
+            LOG(LOG_ERROR, "ERROR reading from socket: %m");
+        closed = 1;  // Connection closed or error
+        break;
+    }
 
-        if (max_index != -1) {
-            // Mark this book as printed
-            printed_books[max_index] = 1;
+    index_received_bytes(conn, closed);
+    if (conn->query == QUERY_ANSWERED) {
+        release_connection(conn);
+        return;
+    }
+    if (closed) {
+        finish_client(conn);
+        return;
+    }
+    rearm_socket(conn);
+}
 
-            // Derive the filename from the connection order/book number
-            char filename[20];
-            sprintf(filename, "book_%02d.txt", max_index + 1);  // e.g., "book_01.txt", "book_02.txt"
+// Re-arm a connection's one-shot socket; epoll reports it again right away if data is still pending.
+// Once it is re-armed the connection may be handled and freed elsewhere, so nothing of it is read after
+void rearm_socket(Connection *conn) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+    ev.data.ptr = conn;
+    int epollfd = conn->reactor->epollfd;
+    int sockfd = conn->sockfd;
+    TSAN_RELEASE(conn);
+    if (rearm_epoll_ctl(epollfd, EPOLL_CTL_MOD, sockfd, &ev) < 0)
+        error("ERROR re-arming client socket");
+}
 
-            // Print the book title and occurrences
-            printf("Book Title: %s (Occurrences: %d)\n", filename, books[max_index].occurrences);
-        }
+// Count bytes just received for a book against the byte budgets
+void charge_bytes(Book *book, size_t n) {
+    if (!budgets_enabled) {
+        return;
     }
+    atomic_fetch_add_explicit(&book->held_bytes, n, memory_order_relaxed);
+    atomic_fetch_add_explicit(&total_held_bytes, n, memory_order_relaxed);
 }
 
+// Note the bytes a job hands the writer thread: its chunk, or for a book's last job everything the
+// book still holds, the incomplete line it drops included
+void queue_bytes(const WriteJob *job) {
+    if (!budgets_enabled) {
+        return;
+    }
+    Book *book = job->book;
+    size_t n = job->last ? atomic_load(&book->held_bytes) - atomic_load(&book->queued_bytes) : job->len;
+    atomic_fetch_add_explicit(&book->queued_bytes, n, memory_order_relaxed);
+    atomic_fetch_add_explicit(&total_queued_bytes, n, memory_order_relaxed);
+}
 
-void *analysis_thread_func(void *arg) {
-    while (1) {
-        sleep(5);  // Wait for 5 seconds (or whatever interval is needed)
+// Stop counting bytes that were written or dropped, and let parked connections that no longer have
+// to wait read again
+void release_bytes(Book *book, size_t held, size_t queued) {
+    if (!budgets_enabled) {
+        return;
+    }
+    atomic_fetch_sub_explicit(&book->held_bytes, held, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&total_held_bytes, held, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&book->queued_bytes, queued, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&total_queued_bytes, queued, memory_order_relaxed);
+    resume_throttled();
+}
 
-        pthread_mutex_lock(&list_mutex);  // Lock the list to ensure only one thread prints
-        print_sorted_books();             // Print the sorted results by occurrences
-        pthread_mutex_unlock(&list_mutex);  // Unlock the list after printing
+// Whether a book's upload, or all uploads together, hold at least their budget
+int over_budget(Book *book) {
+    return (connection_budget > 0 && atomic_load_explicit(&book->held_bytes, memory_order_relaxed) >= connection_budget) ||
+           (global_budget > 0 && atomic_load_explicit(&total_held_bytes, memory_order_relaxed) >= global_budget);
+}
+
+// Whether an upload has to stop reading: it is over a budget, and bytes counted against that budget are
+// with the writer thread, whose writing them brings the count back down. Bytes nobody can write (an
+// incomplete line) never make an upload wait, so waiting always ends
+int must_wait(Book *book) {
+    if (connection_budget > 0 && atomic_load_explicit(&book->held_bytes, memory_order_relaxed) >= connection_budget &&
+        atomic_load_explicit(&book->queued_bytes, memory_order_relaxed) > 0) {
+        return 1;
     }
-    return NULL;
+    return global_budget > 0 && atomic_load_explicit(&total_held_bytes, memory_order_relaxed) >= global_budget &&
+           atomic_load_explicit(&total_queued_bytes, memory_order_relaxed) > 0;
 }
 
-// Function to add a book (list of nodes) to the global shared list
-void add_node_to_global_list(Node *book_head) {
-    if (book_head == NULL) {
-        return;  // No book to add
+// Decide, before a connection reads, whether it may: BUDGET_OK, BUDGET_THROTTLED if it had to wait and
+// is now parked (its socket stays unread until resume_throttled()), or BUDGET_EXCEEDED if its incomplete
+// line alone has reached the connection budget
+int check_budgets(Connection *conn) {
+    Book *book = conn->book;
+    if (!budgets_enabled || book == NULL || conn->query != QUERY_NONE || conn->truncated) {
+        return BUDGET_OK;
+    }
+    if (pipeline_enabled ? atomic_load_explicit(&conn->line_too_long, memory_order_relaxed) : line_over_budget(conn)) {
+        return BUDGET_EXCEEDED;
+    }
+    if (!must_wait(book)) {
+        return BUDGET_OK;
     }
 
-    // Add the book list to the global list (track all books)
-    if (global_list_head == NULL) {
-        global_list_head = book_head;
-    } else {
-        Node *temp = global_list_head;
-        while (temp->next != NULL) {
-            temp = temp->next;
-        }
-        temp->next = book_head;  // Append book to the global list
+    // Check again under the lock the writer thread takes after freeing bytes, so no resume is missed.
+    // Once parked the connection belongs to whoever resumes it
+    pthread_mutex_lock(&throttle_mutex);
+    int wait = must_wait(book);
+    if (wait) {
+        LOG(LOG_DEBUG, "Throttling book_%02d: %zu bytes held, %zu by all uploads", book->id,
+            atomic_load(&book->held_bytes), atomic_load(&total_held_bytes));
+        conn->throttled_since = now_ns();
+        conn->next_throttled = throttled_head;
+        throttled_head = conn;
+        throttled_count++;
     }
+    pthread_mutex_unlock(&throttle_mutex);
+    if (wait) {
+        metrics_count(COUNTER_THROTTLES, 1);
+    }
+    return wait ? BUDGET_THROTTLED : BUDGET_OK;
+}
+
+// Whether the incomplete line in a worker's book has reached the connection budget; it can never be
+// written, so the upload ends instead of waiting
+int line_over_budget(Connection *conn) {
+    return connection_budget > 0 && conn->book->text_len - conn->line_start >= connection_budget;
+}
+
+// io_uring: end an upload whose line outgrew the connection budget. The shutdown ends the reactor's
+// receive; until then whatever arrives is dropped, and the book finishes without the line
+void truncate_upload(Connection *conn) {
+    LOG(LOG_WARN, "Ending book_%02d early: a line is longer than the %zu-byte connection budget", conn->book->id, connection_budget);
+    conn->truncated = 1;
+    shutdown(conn->sockfd, SHUT_RDWR);
 }
 
-void free_global_list(Node *book_head) {
-    Node *temp;
-    while (book_head != NULL) {
-        temp = book_head;
-        book_head = book_head->next;
-        free(temp->data);  // Free the duplicated string
-        free(temp);        // Free the node
+// Let every parked connection that no longer has to wait read again: hand it back to a worker, who
+// re-arms the socket once it is drained, or in the pipeline re-arm it for the receiver
+void resume_throttled(void) {
+    pthread_mutex_lock(&throttle_mutex);
+    Connection **link = &throttled_head;
+    while (*link != NULL) {
+        Connection *conn = *link;
+        if (must_wait(conn->book)) {
+            link = &conn->next_throttled;
+            continue;
+        }
+        *link = conn->next_throttled;
+        throttled_count--;
+        conn->throttled_ns += now_ns() - conn->throttled_since;
+        if (pipeline_enabled) {
+            rearm_socket(conn);
+        } else {
+            schedule_connection(conn);
+        }
     }
+    pthread_mutex_unlock(&throttle_mutex);
 }
 
-// Function to write the current book to a file
-void write_book_to_file(Node *book_head, int connection_order) {
-    char filename[20];
-    sprintf(filename, "book_%02d.txt", connection_order);  // Use connection order for filename
-    FILE *file = fopen(filename, "w");
-    if (file == NULL) {
-        error("ERROR opening file");
-        return;
+// Copy the buffers the reactor received for a connection into its book and index the new lines
+void handle_client_uring(Connection *conn) {
+    Book *book = conn->book;
+
+    // Over a byte budget the receive pauses, so a parked upload holds none of the shared buffers. It
+    // pauses before it is parked: once parked, resume_throttled() may hand it to another worker
+    if (budgets_enabled && conn->query == QUERY_NONE && !conn->truncated && must_wait(book)) {
+        pause_receive(conn);
+    }
+    int allowed = check_budgets(conn);
+    if (allowed == BUDGET_THROTTLED) {
+        return;  // Still scheduled; resume_throttled() hands it back to a worker
+    }
+    if (allowed == BUDGET_EXCEEDED) {
+        truncate_upload(conn);
     }
 
-    Node *temp = book_head;
+    // What arrived while paused comes before anything queued since; the reactor restarts a stopped receive
+    pthread_mutex_lock(&conn->inbox_lock);
+    conn->recv_paused = 0;
+    if (conn->spill_len > 0) {
+        grow_text(book, conn->spill_len);
+        memcpy(book->text + book->text_len, conn->spill, conn->spill_len);
+        book->text_len += conn->spill_len;
+        charge_bytes(book, conn->spill_len);
+        metrics_count(COUNTER_BYTES_RECEIVED, conn->spill_len);
+        conn->spill_len = 0;
+    }
+    int bid = conn->inbox_head;
+    int closed = conn->inbox_closed;
+    conn->inbox_head = conn->inbox_tail = -1;
+    pthread_mutex_unlock(&conn->inbox_lock);
 
-    // Iterate through each node in the linked list (each node is a line)
-    while (temp != NULL) {
-        char *line = temp->data;  // Get the data (the line) from the node
-        int i = 0;
+    // Hand every buffer back to the kernel as soon as its bytes are copied out
+    while (bid >= 0) {
+        int next = recv_chunks[bid].next;
+        if (conn->query == QUERY_ANSWERED || conn->truncated) {
+            recycle_recv_buffer(bid);  // Whatever a client sends after its query is dropped
+            bid = next;
+            continue;
+        }
+        copy_recv_buffer(book, bid);
+        bid = next;
 
-        // Write each character one by one
-        while (line[i] != '\0') {
-            if (line[i] == '\n') {
-                // If we encounter a newline, write it to the file and start a new line
-                fputc('\n', file);
-            } else {
-                // Otherwise, write the character to the file
-                fputc(line[i], file);
+        // A streaming book (or one over a byte budget) is indexed and flushed as it fills, however
+        // many buffers are waiting
+        if (bid >= 0 && ((flush_threshold > 0 && book->text_len - book->text_start >= flush_threshold) || over_budget(book))) {
+            index_received_bytes(conn, 0);
+            if (!conn->truncated && conn->query == QUERY_NONE && line_over_budget(conn)) {
+                truncate_upload(conn);
             }
-            i++;  // Move to the next character
         }
+    }
 
-        // After finishing one node, move to the next node in the list
-        temp = temp->book_next;
+    index_received_bytes(conn, closed);
+    if (closed && conn->query == QUERY_ANSWERED) {
+        release_connection(conn);
+        return;
+    }
+    if (closed) {
+        finish_client(conn);
+        return;
     }
 
-    fclose(file);
-    printf("Data written to file: %s\n", filename);
+    // An answered query waits here for the completion that ends its receive.
+    // Anything that arrived meanwhile goes to the back of the ready queue, like a re-armed socket
+    pthread_mutex_lock(&conn->inbox_lock);
+    int more = conn->inbox_head >= 0 || conn->inbox_closed;
+    if (!more) {
+        conn->scheduled = 0;
+    }
+    pthread_mutex_unlock(&conn->inbox_lock);
+    if (more) {
+        schedule_connection(conn);
+    }
 }
 
-// Function to handle errors
-void error(const char *msg) {
-    perror(msg);
-    exit(1);
+// Pause a throttled connection's receive: the reactor spills whatever still arrives and cancels the
+// receive, and the buffers already queued are copied into the book, indexed and handed back now
+void pause_receive(Connection *conn) {
+    pthread_mutex_lock(&conn->inbox_lock);
+    conn->recv_paused = 1;
+    int bid = conn->inbox_head;
+    conn->inbox_head = conn->inbox_tail = -1;
+    pthread_mutex_unlock(&conn->inbox_lock);
+
+    while (bid >= 0) {
+        int next = recv_chunks[bid].next;
+        copy_recv_buffer(conn->book, bid);
+        bid = next;
+    }
+    index_received_bytes(conn, 0);
 }
 
-// Function to remove BOM (Byte Order Mark) from UTF-8 text
-void remove_bom(char* buffer) {
-    unsigned char bom[] = {0xEF, 0xBB, 0xBF};  // UTF-8 BOM
-    if (memcmp(buffer, bom, 3) == 0) {
-        memmove(buffer, buffer + 3, strlen(buffer) - 2);  // Remove BOM
+// Append one received buffer to a book and hand the buffer back to the kernel
+void copy_recv_buffer(Book *book, int bid) {
+    size_t len = recv_chunks[bid].len;
+    uint64_t start = metrics_start();
+    grow_text(book, len);
+    memcpy(book->text + book->text_len, recv_buffers + (size_t)bid * RECV_BUFFER_SIZE, len);
+    book->text_len += len;
+    recycle_recv_buffer(bid);
+    charge_bytes(book, len);
+    metrics_stop(METRIC_READ, start);
+    metrics_count(COUNTER_BYTES_RECEIVED, len);
+}
+
+// Make room for at least room more bytes in the book's text buffer
+void grow_text(Book *book, size_t room) {
+    if (book->text_cap - book->text_len >= room) {
+        return;
+    }
+    size_t new_cap = book->text_cap ? book->text_cap : TEXT_BUFFER_INITIAL;
+    while (new_cap - book->text_len < room) {
+        new_cap *= 2;
+    }
+    char *text = realloc(book->text, new_cap);
+    if (text == NULL) {
+        error("ERROR growing book text buffer");
+    }
+    book->text = text;
+    book->text_cap = new_cap;
+}
+
+// Index the bytes appended to the book's text buffer since the last call
+void index_received_bytes(Connection *conn, int closed) {
+    Book *book = conn->book;
+
+    // A stream that opens with QUERY_MAGIC asks for results instead of uploading a book; until
+    // enough bytes are in to tell, nothing is indexed
+    if (conn->query == QUERY_NONE && !conn->bom_checked) {
+        int kind = query_handshake(book->text, book->text_len);
+        if (kind == HANDSHAKE_PENDING && !closed) {
+            return;
+        }
+        if (kind == HANDSHAKE_QUERY) {
+            conn->query = QUERY_PENDING;
+        }
+    }
+    if (conn->query != QUERY_NONE) {
+        receive_query(conn, closed);
+        return;
+    }
+
+    // Skip the BOM (Byte Order Mark) at the start of the stream, if present
+    if (!conn->bom_checked && (book->text_len >= 3 || closed)) {
+        conn->line_start = conn->scan_pos = conn->match_start = bom_length(book->text, book->text_len);
+        book->text_start = conn->line_start;
+        conn->bom_checked = 1;
+    }
+
+    // Split the newly received bytes into lines
+    if (conn->bom_checked)
+        accumulate_line(conn);
+
+    // Publish the batch's matches and move the book up the ranking once per batch, not once per match
+    if (conn->pending_occurrences > 0) {
+        publish_occurrences(conn);
+        update_ranking(book);
+    }
+
+    // Streaming: hand the complete lines to the writer thread once enough have built up, or as soon as
+    // there are any while over a byte budget, since bytes only stop counting once they are written
+    if (!closed && conn->line_start > book->text_start &&
+        ((flush_threshold > 0 && conn->line_start - book->text_start >= flush_threshold) || over_budget(book))) {
+        flush_complete_lines(conn, 0);
+    }
+}
+
+// Detach the complete lines from the text buffer and queue them for the writer thread; the
+// incomplete line moves to a fresh buffer, so a streaming book never holds more than one chunk of
+// text (its index still grows with every line)
+void flush_complete_lines(Connection *conn, int last) {
+    Book *book = conn->book;
+    WriteJob *job = calloc(1, sizeof(WriteJob));
+    if (job == NULL) {
+        error("ERROR allocating write job");
     }
+    job->book = book;
+    job->buffer = book->text;  // The writer frees it, so the lines are never copied
+    job->start = book->text_start;
+    job->len = conn->line_start - book->text_start;
+    job->file_offset = book->text_base;
+    job->last = last;
+
+    if (last) {
+        book->text = NULL;
+        book->text_len = book->text_cap = 0;
+    } else {
+        // Sized for the next chunk, not for whatever the old buffer grew to around a long line
+        size_t rest = book->text_len - conn->line_start;
+        size_t cap = rest > flush_threshold ? rest : flush_threshold;
+        cap = cap > BUFFER_SIZE ? cap : BUFFER_SIZE;
+        char *text = malloc(cap);
+        if (text == NULL) {
+            error("ERROR allocating book text buffer");
+        }
+        memcpy(text, book->text + conn->line_start, rest);
+        book->text = text;
+        book->text_len = rest;
+        book->text_cap = cap;
+
+        // Offsets into the buffer shift down to the start of the incomplete line
+        conn->scan_pos -= conn->line_start;
+        conn->match_start = conn->match_start > conn->line_start ? conn->match_start - conn->line_start : 0;
+        conn->line_start = 0;
+    }
+    book->text_base += job->len;
+    book->text_start = 0;
+
+    // Nodes only view lines that are still in memory; the output file is the record of the rest
+    arena_free(&book->arena);
+    book->book_head = book->book_tail = NULL;
+    book->frequent_search_head = book->frequent_search_tail = NULL;
+
+    enqueue_write(job);
+}
+
+// Where a byte of the output file sits in the book's text buffer; it must not have been flushed
+char *book_text_at(const Book *book, size_t file_offset) {
+    return book->text + book->text_start + (file_offset - book->text_base);
+}
+
+// Publish a finished book, hand it to the writer thread and release the connection
+void finish_client(Connection *conn) {
+    // Add the entire book list to the global list
+    uint64_t start = metrics_start();
+    pthread_mutex_lock(&list_mutex);  // Lock the mutex before modifying the global list
+    add_node_to_global_list(conn->book);
+    pthread_mutex_unlock(&list_mutex);  // Unlock the mutex
+    metrics_stop(METRIC_SPLICE, start);
+
+    // The writer thread writes the file and evicts old books; the worker goes straight back to the sockets.
+    // A book that a byte budget made stream part of itself finishes as a streaming book
+    if (flush_threshold > 0 || conn->book->text_base > 0) {
+        flush_complete_lines(conn, 1);
+    } else {
+        enqueue_book_write(conn->book);
+    }
+
+    release_connection(conn);
+}
+
+// Close a connection's socket and free its state
+void release_connection(Connection *conn) {
+    if (conn->throttled_ns > 0) {
+        metrics_record(METRIC_THROTTLED, conn->throttled_ns);
+        LOG(LOG_DEBUG, "book_%02d was throttled for %.3f s", conn->connection_order, conn->throttled_ns / 1e9);
+    }
+    close(conn->sockfd);
+    atomic_fetch_sub(&open_connections, 1);
+    resume_accepting();
+    pthread_mutex_destroy(&conn->inbox_lock);
+    free(conn->spill);
+    free(conn->pending_pattern_occurrences);
+    free(conn->line_pattern_occurrences);
+    free(conn->run_line_ends);
+    free(conn->run_line_occurrences);
+    for (int i = 0; i < conn->task_cap; i++) {
+        free(conn->tasks[i].pattern_occurrences);
+        free(conn->tasks[i].line_pattern_occurrences);
+        free(conn->tasks[i].hits);
+    }
+    free(conn->tasks);
+    free(conn->carry);
+    free(conn);
+}
+
+// Tell a query from an upload by the first bytes of its stream: HANDSHAKE_QUERY once they hold
+// QUERY_MAGIC, HANDSHAKE_PENDING while they could still become it, HANDSHAKE_UPLOAD otherwise
+int query_handshake(const char *bytes, size_t len) {
+    if (len == 0) {
+        return HANDSHAKE_PENDING;
+    }
+    size_t n = len < QUERY_MAGIC_LEN ? len : QUERY_MAGIC_LEN;
+    if (memcmp(bytes, QUERY_MAGIC, n) != 0) {
+        return HANDSHAKE_UPLOAD;
+    }
+    return n == QUERY_MAGIC_LEN ? HANDSHAKE_QUERY : HANDSHAKE_PENDING;
+}
+
+// Answer a query once its first line after QUERY_MAGIC is in. The connection never uploads a book, so the one
+// created for it at accept is dropped (its id is simply skipped) and the socket is shut down:
+// with epoll the caller closes it right away, with io_uring once the reactor's receive ends
+void receive_query(Connection *conn, int closed) {
+    Book *book = conn->book;
+    char query[MAX_QUERY_LENGTH + 1];
+
+    if (conn->query == QUERY_ANSWERED) {
+        return;
+    }
+    conn->query = QUERY_PENDING;
+    const char *line = book->text + QUERY_MAGIC_LEN;
+    size_t available = book->text_len - QUERY_MAGIC_LEN;
+    char *newline = memchr(line, '\n', available);
+    if (newline == NULL && !closed && available < MAX_QUERY_LENGTH) {
+        return;  // Wait for the rest of the line
+    }
+    size_t len = newline != NULL ? (size_t)(newline - line) : available;
+    if (len > MAX_QUERY_LENGTH) {
+        len = MAX_QUERY_LENGTH;
+    }
+    if (len > 0 && line[len - 1] == '\r') {
+        len--;
+    }
+    memcpy(query, line, len);
+    query[len] = '\0';
+
+    release_bytes(book, atomic_load(&book->held_bytes), 0);
+    unregister_book(book);
+    remove_book_from_ranking(book);
+    release_book(book);
+    conn->book = NULL;
+
+    // Replies are sent synchronously, so a client that stops reading holds the worker for a bounded time
+    struct timeval timeout = {QUERY_SEND_TIMEOUT, 0};
+    int flags = fcntl(conn->sockfd, F_GETFL, 0);
+    if (flags == -1 || fcntl(conn->sockfd, F_SETFL, flags & ~O_NONBLOCK) == -1 ||
+        setsockopt(conn->sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0) {
+        LOG(LOG_ERROR, "ERROR preparing socket for query reply: %m");
+    } else {
+        answer_query(conn->sockfd, query);
+    }
+    shutdown(conn->sockfd, SHUT_RDWR);
+    conn->query = QUERY_ANSWERED;
+}
+
+// Reply to one query line (the one after QUERY_MAGIC):
+//   rank [k]           the ranked book list, "book_NN.txt <occurrences>" per line, best first
+//   book <id> [term]   the book's lines that matched the term (any term if none is given)
+void answer_query(int sockfd, char *query) {
+    char *args;
+    if (strncmp(query, "rank", 4) == 0 && (query[4] == '\0' || query[4] == ' ')) {
+        int limit = query[4] == ' ' ? atoi(query + 5) : report_top_k;
+        metrics_count(COUNTER_QUERIES, 1);
+        send_ranking(sockfd, limit);
+        return;
+    }
+    if (strncmp(query, "book ", 5) != 0) {
+        send_text(sockfd, "ERROR unknown query\n");
+        return;
+    }
+
+    int id = (int)strtol(query + 5, &args, 10);
+    int pattern = -1;
+    if (*args == ' ') {
+        for (int p = 0; p < search_term_count; p++) {
+            if (strcmp(args + 1, search_terms[p]) == 0) {
+                pattern = p;
+            }
+        }
+        if (pattern < 0) {
+            send_text(sockfd, "ERROR not a search term\n");
+            return;
+        }
+    } else if (*args != '\0') {
+        send_text(sockfd, "ERROR bad book id\n");
+        return;
+    }
+
+    // Only a book whose output file is complete has a final index to walk
+    metrics_count(COUNTER_QUERIES, 1);
+    Book *book = acquire_book(id);
+    if (book == NULL) {
+        send_text(sockfd, "ERROR no such book in memory\n");
+        return;
+    }
+    if (!atomic_load(&book->written)) {
+        send_text(sockfd, "ERROR book is still being written\n");
+    } else if (send_matching_lines(sockfd, book, pattern) < 0) {
+        LOG(LOG_ERROR, "ERROR sending query reply: %m");
+    }
+    release_book(book);
+}
+
+// Send the top limit books (all of them if limit is 0), as the analysis thread ranks them
+int send_ranking(int sockfd, int limit) {
+    pthread_mutex_lock(&rank_mutex);
+    if (limit <= 0 || limit > rank_heap_size) {
+        limit = rank_heap_size;
+    }
+    pthread_mutex_unlock(&rank_mutex);
+
+    RankEntry *entries = malloc((limit > 0 ? limit : 1) * sizeof(RankEntry));
+    char *reply = malloc((size_t)(limit > 0 ? limit : 1) * 48);
+    if (entries == NULL || reply == NULL) {
+        error("ERROR allocating ranking reply");
+    }
+    for (int i = 0; i < limit; i++) {
+        entries[i].pattern_occurrences = NULL;
+    }
+    int count = collect_top_books(entries, limit);
+
+    size_t len = 0;
+    for (int i = 0; i < count; i++) {
+        len += sprintf(reply + len, "book_%02d.txt %d\n", entries[i].id, entries[i].occurrences);
+    }
+    struct iovec iov = {reply, len};
+    int status = send_all(sockfd, &iov, 1);
+    free(entries);
+    free(reply);
+    return status;
+}
+
+// Stream a written book's matching lines in file order by walking its index: the match lists of
+// the wanted terms are merged, and lines that sit back to back are sent as one run. The runs go
+// out with writev() straight from the book's bytes in memory, or from its output file mapped for
+// the query, so no text is copied in user space. Returns -1 if the client could not be sent to
+int send_matching_lines(int sockfd, Book *book, int pattern) {
+    const uint64_t *offsets = book_line_offsets(book);
+    const char *bytes = book_file_bytes(book);
+    char *file_map = NULL;
+    int first = pattern >= 0 ? pattern : 0;
+    int last = pattern >= 0 ? pattern + 1 : search_term_count;
+    struct iovec iov[IOV_BATCH];
+    int iov_count = 0, status = 0;
+    uint64_t run_start = 0, run_end = 0, next_line = 0;
+
+    // A streamed book's text only lives in its output file. Runs are usually single lines, so
+    // one writev() per IOV_BATCH of them beats a sendfile() per run
+    if (bytes == NULL && book->indexed_len > 0) {
+        char filename[32];
+        snprintf(filename, sizeof(filename), "book_%02d.txt", book->id);
+        int fd = open(filename, O_RDONLY | O_CLOEXEC);
+        file_map = fd >= 0 ? mmap(NULL, book->indexed_len, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0) : MAP_FAILED;
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (file_map == MAP_FAILED) {
+            return send_text(sockfd, "ERROR book file is missing\n");
+        }
+        bytes = file_map;
+    }
+    size_t *cursor = calloc(search_term_count, sizeof(size_t));
+    if (cursor == NULL) {
+        error("ERROR allocating query cursors");
+    }
+
+    while (status == 0) {
+        // The next line after the last one sent that any wanted term matched
+        uint64_t line = UINT64_MAX;
+        for (int p = first; p < last; p++) {
+            size_t count;
+            const uint32_t *lines = book_match_lines(book, p, &count);
+            while (cursor[p] < count && lines[cursor[p]] < next_line) {
+                cursor[p]++;
+            }
+            if (cursor[p] < count && lines[cursor[p]] < line) {
+                line = lines[cursor[p]];
+            }
+        }
+
+        // Send the current run once the next line does not extend it (or there is none)
+        uint64_t start = 0, end = 0;
+        if (line < book->line_count) {
+            start = offsets[line];
+            end = line + 1 < book->line_count ? offsets[line + 1] : book->indexed_len;
+        }
+        if (run_end > run_start && (line >= book->line_count || start != run_end)) {
+            iov[iov_count++] = (struct iovec){(void *)(bytes + run_start), run_end - run_start};
+            if (iov_count == IOV_BATCH) {
+                status = send_all(sockfd, iov, iov_count);
+                iov_count = 0;
+            }
+            run_start = run_end = start;
+        }
+        if (line >= book->line_count) {
+            break;
+        }
+        if (run_end == run_start) {
+            run_start = start;
+        }
+        run_end = end;
+        next_line = line + 1;
+    }
+    if (status == 0 && iov_count > 0) {
+        status = send_all(sockfd, iov, iov_count);
+    }
+
+    if (file_map != NULL) {
+        munmap(file_map, book->indexed_len);
+    }
+    free(cursor);
+    return status;
+}
+
+// Send every byte described by iov to a blocking socket; returns -1 on failure
+int send_all(int sockfd, struct iovec *iov, int iov_count) {
+    while (iov_count > 0) {
+        ssize_t n = writev(sockfd, iov, iov_count);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        iov_advance(&iov, &iov_count, n);
+    }
+    return 0;
+}
+
+// Send a short reply such as an error message
+int send_text(int sockfd, const char *text) {
+    struct iovec iov = {(void *)text, strlen(text)};
+    return send_all(sockfd, &iov, 1);
+}
+
+// The output file offset of every line of a written book, from its index in memory or, for a
+// book loaded at startup, its mapped sidecar index
+const uint64_t *book_line_offsets(const Book *book) {
+    if (book->index_map != NULL) {
+        return (const uint64_t *)(book->index_map + sizeof(IndexHeader) + search_term_count * sizeof(IndexPattern));
+    }
+    return book->line_offsets;
+}
+
+// The lines of a written book that a search term matched, ascending, and how many there are
+const uint32_t *book_match_lines(const Book *book, int pattern, size_t *count) {
+    if (book->index_map != NULL) {
+        const IndexPattern *patterns = (const IndexPattern *)(book->index_map + sizeof(IndexHeader));
+        *count = patterns[pattern].match_count;
+        return (const uint32_t *)(book->index_map + patterns[pattern].match_offset);
+    }
+    *count = book->match_counts[pattern];
+    return book->match_lines[pattern];
+}
+
+// The whole output file of a written book, if its bytes are still in memory or mapped, else NULL
+const char *book_file_bytes(const Book *book) {
+    if (book->text_map != NULL) {
+        return book->text_map;
+    }
+    if (book->text != NULL && book->text_base == 0) {
+        return book->text + book->text_start;  // Written in one go; nothing was flushed early
+    }
+    return NULL;
+}
+
+
+// Match the bytes received since the last call and index every line they complete
+void accumulate_line(Connection *conn) {
+    Book *book = conn->book;
+    size_t pos = conn->scan_pos;
+    size_t first_line = book->line_count;
+    uint64_t start = metrics_start();
+
+    while (pos < book->text_len) {
+        // A long run of complete lines is split into tasks the whole worker pool matches;
+        // the automaton is back at its root state after every newline, so each task starts fresh
+        if (pos == conn->line_start && parallel_match && task_deque != NULL &&
+            book->text_len - pos >= PARALLEL_MATCH_MIN) {
+            size_t end = match_lines_parallel(conn, pos);
+            if (end > pos) {
+                pos = end;
+                continue;
+            }
+        }
+
+        char *newline = memchr(book->text + pos, '\n', book->text_len - pos);
+        size_t stop = newline != NULL ? (size_t)(newline - book->text) + 1 : book->text_len;
+
+        // Matches are counted as the bytes arrive, before the line is complete
+        // One line in METRICS_SAMPLE_EVERY is timed, picked by its number so the other lines pay one test
+        uint64_t sample = metrics_enabled && (book->line_count & (METRICS_SAMPLE_EVERY - 1)) == 0 ? now_ns() : 0;
+        conn->line_occurrences += match_stream(conn, pos, stop);
+        metrics_stop(METRIC_MATCH, sample);
+        if (newline == NULL) {
+            break;
+        }
+
+        // The line keeps its newline character
+        size_t offset = book->text_base + (conn->line_start - book->text_start);
+        sample = sample != 0 ? now_ns() : 0;  // The same lines are timed for both stages
+        add_node_to_book_list(offset, stop - conn->line_start, conn->line_occurrences, book);
+        metrics_stop(METRIC_ADD_NODE, sample);
+
+        // Record the line, and which terms it matched, in the book's index
+        uint32_t line = book->line_count;
+        index_add_line(book, offset, stop - conn->line_start);
+        if (conn->line_occurrences > 0 && search_term_count == 1) {
+            index_add_match(book, 0, line);
+        } else if (conn->line_occurrences > 0) {
+            for (int p = 0; p < search_term_count; p++) {
+                if (conn->line_pattern_occurrences[p] != 0) {
+                    index_add_match(book, p, line);
+                    conn->line_pattern_occurrences[p] = 0;
+                }
+            }
+        }
+        conn->line_start = stop;  // The next line starts after the newline
+        conn->line_occurrences = 0;
+        pos = stop;
+    }
+    conn->scan_pos = book->text_len;
+    metrics_stop(METRIC_SPLIT, start);
+    metrics_count(COUNTER_LINES, book->line_count - first_line);
+}
+
+// Feed book->text[from, to) to the matcher, carrying its state across reads; returns the matches found
+int match_stream(Connection *conn, size_t from, size_t to) {
+    Book *book = conn->book;
+    int found;
+
+    if (search_term_count == 1) {
+        // Test every start position not tested yet whose match would fit in the bytes received
+        size_t start = conn->match_start > conn->line_start ? conn->match_start : conn->line_start;
+        if (to - start < search_term_length) {
+            return 0;
+        }
+        found = count_occurrences(book->text + start, to - start, search_terms[0], search_term_length);
+        conn->match_start = to - search_term_length + 1;
+        conn->pending_pattern_occurrences[0] += found;
+    } else {
+        found = count_matches(&automaton, &conn->match_state, book->text + from, to - from,
+                              conn->pending_pattern_occurrences, conn->line_pattern_occurrences);
+    }
+
+    // The book's counters are updated in one step per batch by publish_occurrences
+    conn->pending_occurrences += found;
+    return found;
+}
+
+// Match the complete lines in book->text[from, ...) on the worker pool and index them in order;
+// returns the end of the last line handled, or from if the run is too short to be worth splitting
+size_t match_lines_parallel(Connection *conn, size_t from) {
+    Book *book = conn->book;
+    const char *last_newline = memrchr(book->text + from, '\n', book->text_len - from);
+    if (last_newline == NULL || (size_t)(last_newline + 1 - book->text) - from < PARALLEL_MATCH_MIN) {
+        return from;
+    }
+    size_t end = (size_t)(last_newline + 1 - book->text);
+
+    // Find every line; memchr runs far ahead of the matchers, so this stays on one thread
+    size_t lines = 0;
+    for (size_t pos = from; pos < end; lines++) {
+        if (lines == conn->run_cap) {
+            size_t cap = conn->run_cap ? conn->run_cap * 2 : 4096;
+            size_t *ends = realloc(conn->run_line_ends, cap * sizeof(size_t));
+            int *occurrences = realloc(conn->run_line_occurrences, cap * sizeof(int));
+            if (ends == NULL || occurrences == NULL) {
+                error("ERROR allocating line run");
+            }
+            conn->run_line_ends = ends;
+            conn->run_line_occurrences = occurrences;
+            conn->run_cap = cap;
+        }
+        pos = (size_t)((char *)memchr(book->text + pos, '\n', end - pos) - book->text) + 1;
+        conn->run_line_ends[lines] = pos;
+    }
+
+    // Cut the run into tasks of about MATCH_TASK_BYTES at line boundaries
+    atomic_int remaining;
+    int task_count = 0;
+    size_t line = 0;
+    atomic_init(&remaining, 0);
+    while (line < lines) {
+        if (task_count == conn->task_cap) {
+            int cap = conn->task_cap ? conn->task_cap * 2 : 16;
+            MatchTask *tasks = realloc(conn->tasks, cap * sizeof(MatchTask));
+            if (tasks == NULL) {
+                error("ERROR allocating match tasks");
+            }
+            memset(tasks + conn->task_cap, 0, (cap - conn->task_cap) * sizeof(MatchTask));
+            for (int i = conn->task_cap; i < cap; i++) {
+                tasks[i].pattern_occurrences = calloc(search_term_count, sizeof(int));
+                tasks[i].line_pattern_occurrences = calloc(search_term_count, sizeof(int));
+                if (tasks[i].pattern_occurrences == NULL || tasks[i].line_pattern_occurrences == NULL) {
+                    error("ERROR allocating match tasks");
+                }
+            }
+            conn->tasks = tasks;
+            conn->task_cap = cap;
+        }
+        MatchTask *task = &conn->tasks[task_count++];
+        size_t start = line == 0 ? from : conn->run_line_ends[line - 1];
+        size_t first = line;
+        while (line < lines && conn->run_line_ends[line] - start < MATCH_TASK_BYTES) {
+            line++;
+        }
+        if (line == first) {
+            line++;  // A single line longer than a task is a task of its own
+        }
+        task->text = book->text;
+        task->start = start;
+        task->line_ends = conn->run_line_ends + first;
+        task->line_occurrences = conn->run_line_occurrences + first;
+        task->line_count = line - first;
+        task->first_line = book->line_count + first;
+        memset(task->pattern_occurrences, 0, search_term_count * sizeof(int));
+        task->hit_count = 0;
+        task->remaining = &remaining;
+    }
+
+    // Queue the tasks (any the deque has no room for run here) and wake the idle workers to steal them;
+    // the deque is LIFO for its owner, so push the last task first and start on the first one
+    atomic_store_explicit(&remaining, task_count, memory_order_relaxed);
+    int pushed = 0;
+    for (int i = task_count - 1; i > 0; i--) {
+        if (!task_push(task_deque, &conn->tasks[i])) {
+            break;
+        }
+        pushed++;
+    }
+    if (pushed > 0) {
+        wake_idle_workers();
+    }
+    for (int i = 0; i < task_count - pushed; i++) {
+        run_match_task(&conn->tasks[i]);
+    }
+
+    // Help until every task of the run is done: our own first, then anyone's
+    while (atomic_load_explicit(&remaining, memory_order_acquire) > 0) {
+        MatchTask *task = task_pop(task_deque);
+        if (task == NULL) {
+            task = steal_any_task();
+            if (task != NULL) {
+                metrics_count(COUNTER_TASKS_STOLEN, 1);
+            }
+        }
+        if (task != NULL) {
+            run_match_task(task);
+        } else {
+            sched_yield();  // The rest are being matched by other workers
+        }
+    }
+
+    // Merge in arrival order: the lines go into the book's list and index exactly as if matched inline
+    for (int t = 0; t < task_count; t++) {
+        MatchTask *task = &conn->tasks[t];
+        index_task_lines(conn, task, task->line_count, book->text_base + (task->start - book->text_start));
+    }
+
+    conn->line_start = end;
+    conn->match_start = end;
+    return end;
+}
+
+// Add the first lines of a matched task to the book's node list and index, the first one at the given
+// output file offset, and all of the task's matches to the connection's pending counts
+void index_task_lines(Connection *conn, MatchTask *task, size_t lines, uint64_t offset) {
+    Book *book = conn->book;
+    size_t pos = task->start;
+    size_t hit = 0;
+    for (size_t i = 0; i < lines; i++) {
+        size_t length = task->line_ends[i] - pos;
+        int found = task->line_occurrences[i];
+        uint64_t sample = metrics_enabled && (book->line_count & (METRICS_SAMPLE_EVERY - 1)) == 0 ? now_ns() : 0;
+        add_node_to_book_list(offset, length, found, book);
+        metrics_stop(METRIC_ADD_NODE, sample);
+
+        uint32_t number = book->line_count;
+        index_add_line(book, offset, length);
+        if (found > 0 && search_term_count == 1) {
+            index_add_match(book, 0, number);
+        }
+        for (; hit < task->hit_count && task->hits[2 * hit] == i; hit++) {
+            index_add_match(book, task->hits[2 * hit + 1], number);
+        }
+        offset += length;
+        pos = task->line_ends[i];
+    }
+    for (int p = 0; p < search_term_count; p++) {
+        conn->pending_pattern_occurrences[p] += task->pattern_occurrences[p];
+        conn->pending_occurrences += task->pattern_occurrences[p];
+    }
+}
+
+// Match every line of a task; runs on whichever worker took it
+void run_match_task(MatchTask *task) {
+    size_t pos = task->start;
+    for (size_t i = 0; i < task->line_count; i++) {
+        size_t stop = task->line_ends[i];
+        uint64_t sample = metrics_enabled && ((task->first_line + i) & (METRICS_SAMPLE_EVERY - 1)) == 0 ? now_ns() : 0;
+        int found;
+        if (search_term_count == 1) {
+            found = count_occurrences(task->text + pos, stop - pos, search_terms[0], search_term_length);
+            task->pattern_occurrences[0] += found;
+        } else {
+            int state = 0;
+            found = count_matches(&automaton, &state, task->text + pos, stop - pos,
+                                  task->pattern_occurrences, task->line_pattern_occurrences);
+            for (int p = 0; found > 0 && p < search_term_count; p++) {
+                if (task->line_pattern_occurrences[p] == 0) {
+                    continue;
+                }
+                if (task->hit_count == task->hit_cap) {
+                    size_t cap = task->hit_cap ? task->hit_cap * 2 : 256;
+                    uint32_t *hits = realloc(task->hits, cap * 2 * sizeof(uint32_t));
+                    if (hits == NULL) {
+                        error("ERROR allocating match hits");
+                    }
+                    task->hits = hits;
+                    task->hit_cap = cap;
+                }
+                task->hits[2 * task->hit_count] = i;
+                task->hits[2 * task->hit_count + 1] = p;
+                task->hit_count++;
+                task->line_pattern_occurrences[p] = 0;
+            }
+        }
+        task->line_occurrences[i] = found;
+        metrics_stop(METRIC_MATCH, sample);
+        pos = stop;
+    }
+
+    // The worker waiting on the run reads the outputs once this reaches 0 (pipeline batches have no run)
+    if (task->remaining != NULL) {
+        atomic_fetch_sub_explicit(task->remaining, 1, memory_order_release);
+    }
+}
+
+// Owner only: add a task at the bottom of the deque; returns 0 if it is full
+int task_push(TaskDeque *deque, MatchTask *task) {
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    if (bottom - top >= TASK_DEQUE_SIZE) {
+        return 0;
+    }
+    atomic_store_explicit(&deque->slots[bottom & (TASK_DEQUE_SIZE - 1)], task, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    atomic_fetch_add(&queued_tasks, 1);
+    return 1;
+}
+
+// Owner only: take the newest task back, racing thieves only for the last one
+MatchTask *task_pop(TaskDeque *deque) {
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    MatchTask *task = NULL;
+    if (top <= bottom) {
+        task = atomic_load_explicit(&deque->slots[bottom & (TASK_DEQUE_SIZE - 1)], memory_order_relaxed);
+        if (top == bottom) {
+            if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                         memory_order_seq_cst, memory_order_relaxed)) {
+                task = NULL;  // A thief got it
+            }
+            atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        }
+    } else {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);  // Empty
+    }
+    if (task != NULL) {
+        atomic_fetch_sub(&queued_tasks, 1);
+    }
+    return task;
+}
+
+// Any thread: take the oldest task from the top of a deque; NULL if it is empty or another thief won
+MatchTask *task_steal(TaskDeque *deque) {
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom) {
+        return NULL;
+    }
+    MatchTask *task = atomic_load_explicit(&deque->slots[top & (TASK_DEQUE_SIZE - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed)) {
+        return NULL;
+    }
+    atomic_fetch_sub(&queued_tasks, 1);
+    return task;
+}
+
+// Steal from the other workers' deques, starting after our own so thieves spread out
+MatchTask *steal_any_task(void) {
+    int count = atomic_load(&task_deque_count);
+    int self = task_deque != NULL ? (int)(task_deque - task_deques) : 0;
+    for (int i = 1; i <= count && atomic_load_explicit(&queued_tasks, memory_order_relaxed) > 0; i++) {
+        TaskDeque *deque = &task_deques[(self + i) % count];
+        if (deque == task_deque) {
+            continue;
+        }
+        MatchTask *task = task_steal(deque);
+        if (task != NULL) {
+            return task;
+        }
+    }
+    return NULL;
+}
+
+// Wake the workers sleeping on every reactor's ready queue so they come and steal
+void wake_idle_workers(void) {
+    for (int i = 0; i < acceptor_count; i++) {
+        pthread_mutex_lock(&reactors[i].ready_mutex);  // A worker between its check and its wait would miss it otherwise
+        reactors[i].task_wakes++;
+        pthread_cond_broadcast(&reactors[i].ready_cond);
+        pthread_mutex_unlock(&reactors[i].ready_mutex);
+    }
+}
+
+// Tell a pipelined stream's query from an upload by peeking at its first QUERY_MAGIC_LEN bytes, so
+// they stay in the socket for the batches. The bytes of a handshake still incomplete are read into the
+// book's text buffer instead (a few at most), or the one-shot socket would be reported again at once
+int peek_handshake(Connection *conn, int *closed) {
+    Book *book = conn->book;
+    char head[QUERY_MAGIC_LEN];
+    size_t have = book->text_len;  // Read by earlier calls
+    memcpy(head, book->text, have);
+
+    ssize_t n;
+    do {
+        n = recv(conn->sockfd, head + have, QUERY_MAGIC_LEN - have, MSG_PEEK);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        n = 0;
+    } else if (n <= 0) {
+        if (n < 0)
+            LOG(LOG_ERROR, "ERROR reading from socket: %m");
+        *closed = 1;  // Connection closed or error
+        n = 0;
+    }
+
+    int kind = query_handshake(head, have + n);
+    if (kind == HANDSHAKE_PENDING && n > 0) {
+        grow_text(book, n);
+        if (read(conn->sockfd, book->text + book->text_len, n) != n) {
+            error("ERROR reading peeked bytes");
+        }
+        book->text_len += n;
+        charge_bytes(book, n);
+        metrics_count(COUNTER_BYTES_RECEIVED, n);
+    }
+    return kind;
+}
+
+// Read a query's bytes into the book's text buffer and answer it once its line is in
+void receive_query_bytes(Connection *conn) {
+    Book *book = conn->book;
+    int closed = 0;
+    while (1) {
+        grow_text(book, BUFFER_SIZE);
+        ssize_t n = read(conn->sockfd, book->text + book->text_len, book->text_cap - book->text_len);
+        if (n > 0) {
+            book->text_len += n;
+            charge_bytes(book, n);
+            metrics_count(COUNTER_BYTES_RECEIVED, n);
+            if (book->text_len >= QUERY_MAGIC_LEN + MAX_QUERY_LENGTH)
+                break;  // Enough to answer, whatever follows
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;  // Socket drained, wait for the next edge
+
+        if (n < 0)
+            LOG(LOG_ERROR, "ERROR reading from socket: %m");
+        closed = 1;  // Connection closed or error
+        break;
+    }
+
+    index_received_bytes(conn, closed);
+    if (conn->query == QUERY_ANSWERED) {
+        release_connection(conn);
+        return;
+    }
+    rearm_socket(conn);
+}
+
+// Receive stage: read a ready socket into batches and pass them to the connection's splitter. A query
+// is answered right here instead, as a worker would, and never enters the pipeline. A connection
+// whose splitter is behind is parked unread, so stage_send() never waits in a receiver
+void receive_batches(Connection *conn) {
+    size_t budget = READ_BUDGET;
+    int closed = 0, drained = 0;
+
+    // Over a byte budget the socket is left unread, as in a worker; an upload that ends early sends
+    // its last batch empty
+    int allowed = check_budgets(conn);
+    if (allowed == BUDGET_THROTTLED) {
+        return;  // resume_throttled() re-arms the socket
+    }
+    if (allowed == BUDGET_EXCEEDED) {
+        LOG(LOG_WARN, "Ending book_%02d early: a line is longer than the %zu-byte connection budget", conn->connection_order,
+            connection_budget);
+        closed = 1;
+    }
+
+    // Until the stream is known not to open with QUERY_MAGIC it is only peeked at, so an upload's
+    // bytes go straight into batches; a query is read into the book's text buffer and answered there
+    if (!conn->pipelined && conn->query == QUERY_NONE && !closed) {
+        int kind = peek_handshake(conn, &closed);
+        if (kind == HANDSHAKE_PENDING && !closed) {
+            rearm_socket(conn);
+            return;
+        }
+        if (kind == HANDSHAKE_QUERY) {
+            conn->query = QUERY_PENDING;
+        }
+    }
+    if (conn->query != QUERY_NONE) {
+        receive_query_bytes(conn);
+        return;
+    }
+
+    while (budget > 0 && !drained) {
+        // Read no more of an upload than its splitter has room for; the reactor goes on with the
+        // other sockets
+        if (!split_ring_has_room(conn)) {
+            park_connection(conn);
+            return;
+        }
+        Batch *batch = create_batch(conn);
+        if (!conn->pipelined && conn->book->text_len > 0) {
+            // The first bytes of a handshake that came in pieces, read while it could still be a query.
+            // Once the connection is pipelined the book's text belongs to its aggregator
+            memcpy(batch->data, conn->book->text, conn->book->text_len);
+            batch->len = conn->book->text_len;
+            conn->book->text_len = 0;
+        }
+        while (!closed && batch->len < batch->cap && budget > 0) {
+            size_t room = batch->cap - batch->len;
+            uint64_t start = metrics_start();
+            ssize_t n = read(conn->sockfd, batch->data + batch->len, room < budget ? room : budget);
+            metrics_stop(METRIC_READ, start);
+            if (n > 0) {
+                batch->len += n;
+                budget -= n;
+                charge_bytes(conn->book, n);
+                metrics_count(COUNTER_BYTES_RECEIVED, n);
+                continue;
+            }
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                drained = 1;  // Socket drained, wait for the next edge
+                break;
+            }
+
+            if (n < 0)
+                LOG(LOG_ERROR, "ERROR reading from socket: %m");
+            closed = 1;  // Connection closed or error
+            break;
+        }
+
+        if (batch->len == 0 && !closed) {
+            free_batch(batch);
+            break;
+        }
+
+        // The aggregator releases the connection after the last batch, so the socket leaves epoll first
+        conn->pipelined = 1;
+        batch->last = closed;
+        if (closed && epoll_ctl(conn->reactor->epollfd, EPOLL_CTL_DEL, conn->sockfd, NULL) < 0)
+            error("ERROR removing client socket from epoll");
+        stage_count(&stage_thread->batches, 1);
+        stage_send(stage_thread, stage_route(conn, STAGE_SPLIT), batch);
+        if (closed) {
+            return;
+        }
+    }
+    rearm_socket(conn);
+}
+
+// Allocate an empty batch of the connection's bytes
+Batch *create_batch(Connection *conn) {
+    Batch *batch = calloc(1, sizeof(Batch));
+    if (batch == NULL) {
+        error("ERROR allocating batch");
+    }
+    batch->conn = conn;
+    batch->cap = PIPELINE_BATCH_BYTES;
+    batch->data = malloc(batch->cap);
+    batch->match.pattern_occurrences = calloc(search_term_count, sizeof(int));
+    batch->match.line_pattern_occurrences = calloc(search_term_count, sizeof(int));
+    if (batch->data == NULL || batch->match.pattern_occurrences == NULL || batch->match.line_pattern_occurrences == NULL) {
+        error("ERROR allocating batch");
+    }
+    return batch;
+}
+
+// Free a batch and the line and match arrays it carries
+void free_batch(Batch *batch) {
+    free(batch->data);
+    free(batch->line_ends);
+    free(batch->line_occurrences);
+    free(batch->match.pattern_occurrences);
+    free(batch->match.line_pattern_occurrences);
+    free(batch->match.hits);
+    free(batch);
+}
+
+// Split stage: cut a batch after its last newline, so every batch a matcher gets is whole lines; the
+// bytes after it wait in the connection for the next batch. Returns 0 if the batch was all carried
+int split_batch(Batch *batch) {
+    Connection *conn = batch->conn;
+
+    // After a line too long for the connection budget the upload is ending; the rest is dropped
+    if (atomic_load_explicit(&conn->line_too_long, memory_order_relaxed)) {
+        batch->len = 0;
+        if (!batch->last) {
+            return 0;
+        }
+    }
+
+    // Nothing to match until a line ends (or the stream does), and the BOM check needs 3 bytes
+    if (!batch->last && ((!conn->bom_checked && conn->carry_len + batch->len < 3) ||
+                         memrchr(batch->data, '\n', batch->len) == NULL)) {
+        carry_bytes(conn, batch->data, batch->len);
+        limit_carry(conn);
+        return 0;
+    }
+
+    // The carried bytes go in front: the batch takes the carry buffer, the connection the batch's
+    if (conn->carry_len > 0) {
+        carry_bytes(conn, batch->data, batch->len);
+        char *data = conn->carry;
+        size_t cap = conn->carry_cap;
+        conn->carry = batch->data;
+        conn->carry_cap = batch->cap;
+        batch->data = data;
+        batch->cap = cap;
+        batch->len = conn->carry_len;
+        conn->carry_len = 0;
+    }
+
+    // Skip the BOM (Byte Order Mark) at the start of the stream, if present
+    size_t start = 0;
+    if (!conn->bom_checked) {
+        start = bom_length(batch->data, batch->len);
+        conn->bom_checked = 1;
+    }
+
+    size_t lines = 0, line_cap = 0, pos = start;
+    char *newline;
+    while (pos < batch->len && (newline = memchr(batch->data + pos, '\n', batch->len - pos)) != NULL) {
+        if (lines + 1 >= line_cap) {  // One spare slot for an unterminated last line
+            line_cap = line_cap ? line_cap * 2 : 1024;
+            size_t *ends = realloc(batch->line_ends, line_cap * sizeof(size_t));
+            int *occurrences = realloc(batch->line_occurrences, line_cap * sizeof(int));
+            if (ends == NULL || occurrences == NULL) {
+                error("ERROR allocating batch lines");
+            }
+            batch->line_ends = ends;
+            batch->line_occurrences = occurrences;
+        }
+        pos = (size_t)(newline - batch->data) + 1;
+        batch->line_ends[lines++] = pos;
+    }
+    batch->lines = lines;
+
+    // Matches in an unterminated last line still count, though the line is not indexed, as inline
+    if (pos < batch->len && batch->last) {
+        if (line_cap == 0) {
+            batch->line_ends = malloc(sizeof(size_t));
+            batch->line_occurrences = malloc(sizeof(int));
+            if (batch->line_ends == NULL || batch->line_occurrences == NULL) {
+                error("ERROR allocating batch lines");
+            }
+        }
+        batch->line_ends[lines++] = batch->len;
+    } else if (pos < batch->len) {
+        carry_bytes(conn, batch->data + pos, batch->len - pos);
+        batch->len = pos;
+        limit_carry(conn);
+    }
+
+    MatchTask *task = &batch->match;
+    task->text = batch->data;
+    task->start = start;
+    task->line_ends = batch->line_ends;
+    task->line_occurrences = batch->line_occurrences;
+    task->line_count = lines;
+    task->first_line = conn->lines_split;
+    conn->lines_split += batch->lines;
+    return 1;
+}
+
+// Append bytes to the connection's incomplete line
+void carry_bytes(Connection *conn, const char *bytes, size_t len) {
+    if (conn->carry_cap - conn->carry_len < len) {
+        size_t cap = conn->carry_cap ? conn->carry_cap : PIPELINE_BATCH_BYTES;
+        while (cap - conn->carry_len < len) {
+            cap *= 2;
+        }
+        char *carry = realloc(conn->carry, cap);
+        if (carry == NULL) {
+            error("ERROR growing carried line");
+        }
+        conn->carry = carry;
+        conn->carry_cap = cap;
+    }
+    memcpy(conn->carry + conn->carry_len, bytes, len);
+    conn->carry_len += len;
+}
+
+// Drop an incomplete line that has outgrown the connection budget and have the receiver end the upload,
+// as a worker does; until it does, split_batch() drops whatever else arrives
+void limit_carry(Connection *conn) {
+    if (connection_budget > 0 && conn->carry_len >= connection_budget) {
+        conn->carry_len = 0;
+        atomic_store_explicit(&conn->line_too_long, 1, memory_order_relaxed);
+    }
+}
+
+// Aggregate stage: append a matched batch's lines to the book's text, node list and index, publish
+// its matches, stream or finish the book, then free the batch
+void aggregate_batch(Batch *batch) {
+    Connection *conn = batch->conn;
+    Book *book = conn->book;
+
+    // The batch's lines are whole and the BOM is gone, so the text buffer only ever holds complete lines
+    uint64_t offset = book->text_base + (book->text_len - book->text_start);
+    if (batch->lines > 0) {
+        size_t len = batch->line_ends[batch->lines - 1] - batch->match.start;
+        grow_text(book, len);
+        memcpy(book->text + book->text_len, batch->data + batch->match.start, len);
+        book->text_len += len;
+        conn->line_start = conn->scan_pos = conn->match_start = book->text_len;
+    }
+    index_task_lines(conn, &batch->match, batch->lines, offset);
+    metrics_count(COUNTER_LINES, batch->lines);
+
+    // Publish the batch's matches and move the book up the ranking once per batch, as a worker does
+    if (conn->pending_occurrences > 0) {
+        publish_occurrences(conn);
+        update_ranking(book);
+    }
+
+    if (batch->last) {
+        finish_client(conn);
+    } else if (conn->line_start > book->text_start &&
+               ((flush_threshold > 0 && conn->line_start - book->text_start >= flush_threshold) || over_budget(book))) {
+        flush_complete_lines(conn, 0);
+    }
+    free_batch(batch);
+}
+
+// Split, match or aggregate thread: take each batch from the previous stage, do this stage's part
+// and pass it on
+void *stage_thread_func(void *arg) {
+    StageThread *self = (StageThread *)arg;
+    stage_thread = self;
+    if (self->cpu >= 0) {
+        pin_to_cpu(self->cpu);
+    }
+
+    while (1) {
+        Batch *batch = stage_receive(self);
+        if (self->stage == STAGE_SPLIT) {
+            uint64_t start = metrics_start();
+            int whole = split_batch(batch);
+            metrics_stop(METRIC_SPLIT, start);
+            if (whole) {
+                stage_send(self, stage_route(batch->conn, STAGE_MATCH), batch);
+            } else {
+                free_batch(batch);
+            }
+        } else if (self->stage == STAGE_MATCH) {
+            run_match_task(&batch->match);
+            stage_send(self, stage_route(batch->conn, STAGE_AGGREGATE), batch);
+        } else {
+            aggregate_batch(batch);
+        }
+    }
+    return NULL;
+}
+
+// The thread of a stage that handles a connection. A connection always takes the same path, so its
+// batches reach every stage in order without being sequenced
+int stage_route(const Connection *conn, int stage) {
+    return conn->connection_order % stage_sizes[stage];
+}
+
+// Pass an item to thread `to` of the next stage, waiting while its ring is full. The wait backs up
+// to the receivers, which then stop reading the sockets behind the full rings and let TCP slow
+// those clients down
+void stage_send(StageThread *self, int to, void *item) {
+    StageRing *ring = self->outputs[to];
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == PIPELINE_RING_SIZE) {
+        uint64_t start = now_ns();
+        while (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == PIPELINE_RING_SIZE) {
+            stage_wait(self, ring);
+        }
+        stage_count(&self->blocked_ns, now_ns() - start);
+    }
+    ring->slots[head & (PIPELINE_RING_SIZE - 1)] = item;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    stage_wake(ring->consumer);
+}
+
+// Take the next item from the input rings, taking turns between them, or NULL if they are all empty
+void *stage_poll(StageThread *self) {
+    for (int i = 0; i < self->input_count; i++) {
+        StageRing *ring = self->inputs[self->next_input];
+        self->next_input = (self->next_input + 1) % self->input_count;
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        if (tail != atomic_load_explicit(&ring->head, memory_order_acquire)) {
+            void *item = ring->slots[tail & (PIPELINE_RING_SIZE - 1)];
+            atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+            stage_wake(ring->producer);
+            stage_count(&self->batches, 1);
+            return item;
+        }
+    }
+    return NULL;
+}
+
+// Take the next item from the input rings, waiting for one if they are all empty
+void *stage_receive(StageThread *self) {
+    void *item;
+    while ((item = stage_poll(self)) == NULL) {
+        uint64_t start = now_ns();
+        stage_wait(self, NULL);
+        stage_count(&self->idle_ns, now_ns() - start);
+    }
+    return item;
+}
+
+// Whether a waiting thread can go on: its full output ring has room, or (full is NULL) an input has an item
+int stage_ready(StageThread *self, StageRing *full) {
+    if (full != NULL) {
+        return atomic_load_explicit(&full->head, memory_order_relaxed) -
+               atomic_load_explicit(&full->tail, memory_order_acquire) < PIPELINE_RING_SIZE;
+    }
+    for (int i = 0; i < self->input_count; i++) {
+        StageRing *ring = self->inputs[i];
+        if (atomic_load_explicit(&ring->tail, memory_order_relaxed) != atomic_load_explicit(&ring->head, memory_order_acquire)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Wait until stage_ready(): poll a little, yielding so that on a shared core the thread that will end
+// the wait gets to run, then sleep on the futex. Announcing the sleep and checking again, against
+// stage_wake() publishing and then checking for sleepers, loses no wakeup
+void stage_wait(StageThread *self, StageRing *full) {
+    for (int spin = 0; spin < PIPELINE_SPINS; spin++) {
+        if (stage_ready(self, full)) {
+            return;
+        }
+        sched_yield();
+    }
+
+    unsigned seq = atomic_load_explicit(&self->wake_seq, memory_order_relaxed);
+    atomic_store_explicit(&self->sleeping, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!stage_ready(self, full)) {
+        syscall(SYS_futex, &self->wake_seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+    }
+    atomic_store_explicit(&self->sleeping, 0, memory_order_relaxed);
+}
+
+// Wake a pipeline thread after putting an item in, or taking one out of, a ring it waits on.
+// A receiver is woken through its reactor's epoll, once however many splitters make room
+void stage_wake(StageThread *thread) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!atomic_load_explicit(&thread->sleeping, memory_order_relaxed)) {
+        return;
+    }
+    if (thread->wake_fd >= 0) {
+        uint64_t one = 1;
+        if (atomic_exchange(&thread->sleeping, 0) && write(thread->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            LOG(LOG_ERROR, "ERROR waking pipeline receiver: %m");
+        }
+        return;
+    }
+    atomic_fetch_add(&thread->wake_seq, 1);
+    syscall(SYS_futex, &thread->wake_seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+// Add n to a count or timing that only the calling thread writes
+void stage_count(atomic_ulong *value, uint64_t n) {
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+// Receive stage: whether the connection's split ring can take another batch. The receiver is the
+// ring's only producer, so the room cannot go away before it sends
+int split_ring_has_room(Connection *conn) {
+    return stage_ready(stage_thread, stage_thread->outputs[stage_route(conn, STAGE_SPLIT)]);
+}
+
+// Receive stage: leave a connection unread, its socket disarmed, until resume_parked() finds room
+// in its split ring. Time with any connection parked counts as the receiver's backpressure
+void park_connection(Connection *conn) {
+    if (stage_thread->parked == NULL) {
+        stage_thread->parked_since = now_ns();
+    }
+    conn->next_parked = stage_thread->parked;
+    stage_thread->parked = conn;
+}
+
+// Receive stage: re-arm the parked connections whose split rings have room again, so epoll reports
+// them (with whatever they sent meanwhile) like any other socket. Announcing the wait before
+// checking, against stage_wake() publishing room before checking for it, loses no wakeup
+void resume_parked(StageThread *self) {
+    atomic_store_explicit(&self->sleeping, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    Connection **link = &self->parked;
+    while (*link != NULL) {
+        Connection *conn = *link;
+        if (stage_ready(self, self->outputs[stage_route(conn, STAGE_SPLIT)])) {
+            *link = conn->next_parked;
+            rearm_socket(conn);
+        } else {
+            link = &conn->next_parked;
+        }
+    }
+    if (self->parked == NULL) {
+        atomic_store_explicit(&self->sleeping, 0, memory_order_relaxed);
+        stage_count(&self->blocked_ns, now_ns() - self->parked_since);
+    }
+}
+
+// Create every stage's threads and a ring between each pair in neighbouring stages, then start the split,
+// match and aggregate threads; the reactors and the writer thread take their places as they start
+void start_pipeline(void) {
+    stage_sizes[STAGE_RECEIVE] = acceptor_count;
+    stage_sizes[STAGE_PERSIST] = 1;
+
+    // With a core for every thread each gets its own; otherwise sharing them is left to the scheduler
+    cpu_set_t allowed;
+    int cpus = sched_getaffinity(0, sizeof(allowed), &allowed) == 0 ? CPU_COUNT(&allowed) : 1;
+    int total = 0, slot = 0;
+    for (int stage = 0; stage < PIPELINE_STAGES; stage++) {
+        total += stage_sizes[stage];
+    }
+
+    for (int stage = 0; stage < PIPELINE_STAGES; stage++) {
+        stage_threads[stage] = aligned_alloc(CACHE_LINE_SIZE, stage_sizes[stage] * sizeof(StageThread));
+        if (stage_threads[stage] == NULL) {
+            error("ERROR allocating pipeline threads");
+        }
+        memset(stage_threads[stage], 0, stage_sizes[stage] * sizeof(StageThread));
+        for (int i = 0; i < stage_sizes[stage]; i++) {
+            StageThread *thread = &stage_threads[stage][i];
+            thread->stage = stage;
+            thread->index = i;
+            thread->wake_fd = stage == STAGE_RECEIVE ? eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC) : -1;
+            if (stage == STAGE_RECEIVE && thread->wake_fd < 0) {
+                error("ERROR creating pipeline wakeup");
+            }
+            thread->cpu = total <= cpus ? slot++ : -1;
+            if (stage > 0) {
+                thread->input_count = stage_sizes[stage - 1];
+                thread->inputs = calloc(thread->input_count, sizeof(StageRing *));
+                if (thread->inputs == NULL) {
+                    error("ERROR allocating pipeline rings");
+                }
+            }
+            if (stage + 1 < PIPELINE_STAGES) {
+                thread->outputs = calloc(stage_sizes[stage + 1], sizeof(StageRing *));
+                if (thread->outputs == NULL) {
+                    error("ERROR allocating pipeline rings");
+                }
+            }
+        }
+    }
+
+    for (int stage = 0; stage + 1 < PIPELINE_STAGES; stage++) {
+        for (int i = 0; i < stage_sizes[stage]; i++) {
+            for (int j = 0; j < stage_sizes[stage + 1]; j++) {
+                StageRing *ring = aligned_alloc(CACHE_LINE_SIZE, sizeof(StageRing));
+                if (ring == NULL) {
+                    error("ERROR allocating pipeline rings");
+                }
+                memset(ring, 0, sizeof(StageRing));
+                ring->producer = &stage_threads[stage][i];
+                ring->consumer = &stage_threads[stage + 1][j];
+                ring->producer->outputs[j] = ring;
+                ring->consumer->inputs[i] = ring;
+            }
+        }
+    }
+    LOG(LOG_INFO, "Pipeline: %d receivers, %d splitters, %d matchers, %d aggregators, 1 writer (%s)",
+        stage_sizes[STAGE_RECEIVE], stage_sizes[STAGE_SPLIT], stage_sizes[STAGE_MATCH], stage_sizes[STAGE_AGGREGATE],
+        total <= cpus ? "pinned" : "not pinned: fewer cores than threads");
+
+    for (int stage = STAGE_SPLIT; stage <= STAGE_AGGREGATE; stage++) {
+        for (int i = 0; i < stage_sizes[stage]; i++) {
+            pthread_t thread_id;
+            if (pthread_create(&thread_id, NULL, stage_thread_func, &stage_threads[stage][i]) != 0) {
+                error("ERROR creating thread");
+            }
+            pthread_detach(thread_id);
+        }
+    }
+}
+
+// Add the connection's pending matches to its book's counters under the book's seqlock
+void publish_occurrences(Connection *conn) {
+    Book *book = conn->book;
+    unsigned seq = atomic_load_explicit(&book->counter_seq, memory_order_relaxed);
+
+    // Odd sequence: readers retry instead of seeing a half-updated set of counters
+    atomic_store_explicit(&book->counter_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    metrics_count(COUNTER_MATCHES, conn->pending_occurrences);
+
+    // Only this worker writes the counters, so a load and a store are enough
+    int total = atomic_load_explicit(&book->occurrences, memory_order_relaxed);
+    atomic_store_explicit(&book->occurrences, total + conn->pending_occurrences, memory_order_relaxed);
+    for (int p = 0; p < search_term_count; p++) {
+        if (conn->pending_pattern_occurrences[p] != 0) {
+            int count = atomic_load_explicit(&book->pattern_occurrences[p], memory_order_relaxed);
+            atomic_store_explicit(&book->pattern_occurrences[p], count + conn->pending_pattern_occurrences[p], memory_order_relaxed);
+            conn->pending_pattern_occurrences[p] = 0;
+        }
+    }
+
+    atomic_store_explicit(&book->counter_seq, seq + 2, memory_order_release);
+    conn->pending_occurrences = 0;
+}
+
+// Copy a consistent view of a book's counters without blocking the worker updating them
+void snapshot_occurrences(Book *book, int *occurrences, int *pattern_occurrences) {
+    unsigned before, after;
+    do {
+        before = atomic_load_explicit(&book->counter_seq, memory_order_acquire);
+        if (before & 1) {
+            continue;  // An update is in progress
+        }
+        *occurrences = atomic_load_explicit(&book->occurrences, memory_order_relaxed);
+        for (int p = 0; pattern_occurrences != NULL && p < search_term_count; p++) {
+            pattern_occurrences[p] = atomic_load_explicit(&book->pattern_occurrences[p], memory_order_relaxed);
+        }
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&book->counter_seq, memory_order_relaxed);
+    } while ((before & 1) || before != after);
+}
+
+void add_node_to_book_list(size_t offset, size_t length, int found_occurrences, Book *book) {
+    // Create a new node viewing the line, by its place in the output file
+    Node *new_node = (Node *)arena_alloc(&book->arena, sizeof(Node));
+    new_node->offset = offset;
+    new_node->length = length;
+    new_node->book_next = NULL;
+    new_node->next_frequent_search = NULL;
+
+    // Append to the book-specific list (this tracks all nodes in the book)
+    if (book->book_tail == NULL) {
+        book->book_head = new_node;
+    } else {
+        book->book_tail->book_next = new_node;
+    }
+    book->book_tail = new_node;
+
+    // If the line contains any search term, add it to the frequent search list
+    if (found_occurrences > 0) {
+        if (book->frequent_search_tail == NULL) {
+            book->frequent_search_head = new_node;
+        } else {
+            book->frequent_search_tail->next_frequent_search = new_node;
+        }
+        book->frequent_search_tail = new_node;
+    }
+
+    LOG(LOG_TRACE, "Added node: %.*s", (int)length, book_text_at(book, offset));
+}
+
+void init_registry(void) {
+    for (int i = 0; i < REGISTRY_SHARDS; i++) {
+        pthread_mutex_init(&registry[i].lock, NULL);
+        registry[i].buckets = NULL;
+        registry[i].bucket_count = 0;
+        registry[i].size = 0;
+    }
+}
+
+// Spread consecutive ids over shards and buckets
+unsigned registry_hash(int id) {
+    return (unsigned)id * 2654435761u;
+}
+
+// Allocate a book with a fresh id and make it visible to the registry and the ranking
+Book *create_book(void) {
+    return create_book_with_id(atomic_fetch_add(&last_book_id, 1) + 1);
+}
+
+// Allocate a book with the given id and make it visible to the registry and the ranking
+Book *create_book_with_id(int id) {
+    Book *book = aligned_alloc(CACHE_LINE_SIZE, (sizeof(Book) + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1));
+    size_t counters_size = (search_term_count * sizeof(atomic_int) + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+    atomic_int *counters = aligned_alloc(CACHE_LINE_SIZE, counters_size);
+    if (book == NULL || counters == NULL) {
+        error("ERROR allocating book");
+    }
+    memset(book, 0, sizeof(Book));
+    atomic_init(&book->counter_seq, 0);
+    atomic_init(&book->occurrences, 0);
+    atomic_init(&book->written, 0);
+    atomic_init(&book->refs, 1);
+    book->out_fd = -1;
+    for (int p = 0; p < search_term_count; p++) {
+        atomic_init(&counters[p], 0);
+    }
+    book->pattern_occurrences = counters;
+    book->id = id;
+    book->match_lines = calloc(search_term_count, sizeof(uint32_t *));
+    book->match_counts = calloc(search_term_count, sizeof(size_t));
+    book->match_caps = calloc(search_term_count, sizeof(size_t));
+    if (book->match_lines == NULL || book->match_counts == NULL || book->match_caps == NULL) {
+        error("ERROR allocating book index");
+    }
+
+    register_book(book);
+    add_book_to_ranking(book);
+    return book;
+}
+
+// Release a book that is no longer reachable from the registry, ranking or global list
+void free_book(Book *book) {
+    arena_free(&book->arena);  // Releases every node in one shot
+    free(book->text);
+    free(book->pattern_occurrences);
+    free(book->line_offsets);
+    for (int p = 0; p < search_term_count; p++) {
+        free(book->match_lines[p]);
+    }
+    free(book->match_lines);
+    free(book->match_counts);
+    free(book->match_caps);
+    if (book->index_map != NULL) {
+        munmap(book->index_map, book->index_map_len);
+    }
+    if (book->text_map != NULL) {
+        munmap(book->text_map, book->text_map_len);
+    }
+    free(book);
+}
+
+void register_book(Book *book) {
+    unsigned hash = registry_hash(book->id);
+    RegistryShard *shard = &registry[hash % REGISTRY_SHARDS];
+
+    pthread_mutex_lock(&shard->lock);
+
+    // Double the bucket array once the shard averages one book per bucket
+    if (shard->size >= shard->bucket_count) {
+        size_t new_count = shard->bucket_count ? shard->bucket_count * 2 : 16;
+        Book **buckets = calloc(new_count, sizeof(Book *));
+        if (buckets == NULL) {
+            error("ERROR growing book registry");
+        }
+        for (size_t i = 0; i < shard->bucket_count; i++) {
+            Book *entry = shard->buckets[i];
+            while (entry != NULL) {
+                Book *next = entry->registry_next;
+                size_t slot = (registry_hash(entry->id) / REGISTRY_SHARDS) & (new_count - 1);
+                entry->registry_next = buckets[slot];
+                buckets[slot] = entry;
+                entry = next;
+            }
+        }
+        free(shard->buckets);
+        shard->buckets = buckets;
+        shard->bucket_count = new_count;
+    }
+
+    size_t slot = (hash / REGISTRY_SHARDS) & (shard->bucket_count - 1);
+    book->registry_next = shard->buckets[slot];
+    shard->buckets[slot] = book;
+    shard->size++;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void unregister_book(Book *book) {
+    unsigned hash = registry_hash(book->id);
+    RegistryShard *shard = &registry[hash % REGISTRY_SHARDS];
+
+    pthread_mutex_lock(&shard->lock);
+    if (shard->bucket_count > 0) {
+        Book **link = &shard->buckets[(hash / REGISTRY_SHARDS) & (shard->bucket_count - 1)];
+        while (*link != NULL && *link != book) {
+            link = &(*link)->registry_next;
+        }
+        if (*link != NULL) {
+            *link = book->registry_next;
+            shard->size--;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// The registered book with this id in its shard, or NULL; the caller holds shard->lock
+Book *registry_lookup_locked(RegistryShard *shard, unsigned hash, int id) {
+    if (shard->bucket_count == 0) {
+        return NULL;
+    }
+    Book *book = shard->buckets[(hash / REGISTRY_SHARDS) & (shard->bucket_count - 1)];
+    while (book != NULL && book->id != id) {
+        book = book->registry_next;
+    }
+    return book;
+}
+
+// Look a book up by id and keep it from being freed until release_book(); NULL once it has been evicted
+Book *acquire_book(int id) {
+    unsigned hash = registry_hash(id);
+    RegistryShard *shard = &registry[hash % REGISTRY_SHARDS];
+
+    pthread_mutex_lock(&shard->lock);
+    Book *book = registry_lookup_locked(shard, hash, id);
+    if (book != NULL) {
+        atomic_fetch_add(&book->refs, 1);  // Eviction unregisters under this lock, so the book is still live
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return book;
+}
+
+// Drop a reference to a book; the last one frees it
+void release_book(Book *book) {
+    if (atomic_fetch_sub(&book->refs, 1) == 1) {
+        free_book(book);
+    }
+}
+
+// Evict the oldest completed books that the retention policies (-m, -T, -M) no longer keep; their
+// output files stay on disk. Returns the now_ns() time at which the oldest remaining book expires
+// under -T, or 0 if no book will expire before the writer thread completes another
+uint64_t evict_completed_books(void) {
+    Book *evicted = NULL;
+    int count = 0;
+    size_t bytes = 0;
+    uint64_t expires = 0;
+
+    if (max_completed_books == 0 && max_book_age_ns == 0 && max_retained_bytes == 0) {
+        return 0;
+    }
+
+    // Unlink under list_mutex; the frees happen after it is released.
+    // A book still waiting for the writer thread stops the sweep until it is on disk
+    pthread_mutex_lock(&list_mutex);
+    uint64_t now = now_ns();
+    while (global_list_head != NULL && atomic_load(&global_list_head->written) && retention_exceeded(global_list_head, now)) {
+        Book *book = global_list_head;
+        global_list_head = book->next;
+        if (global_list_head == NULL) {
+            global_list_tail = NULL;
+        }
+        completed_book_count--;
+        retained_bytes -= book->retained_bytes;
+        bytes += book->retained_bytes;
+        count++;
+        book->next = evicted;
+        evicted = book;
+    }
+    if (max_book_age_ns > 0 && global_list_head != NULL && atomic_load(&global_list_head->written)) {
+        expires = global_list_head->completed_ns + max_book_age_ns;
+    }
+    pthread_mutex_unlock(&list_mutex);
+
+    // Readers never walk the global list: they reach a book through the registry (holding a
+    // reference) or the ranking (under rank_mutex). Once the book is out of both, the last
+    // reference frees it, so a query still reading the book frees it when done
+    while (evicted != NULL) {
+        Book *next = evicted->next;
+        unregister_book(evicted);
+        remove_book_from_ranking(evicted);
+        release_book(evicted);
+        evicted = next;
+    }
+    if (count > 0) {
+        metrics_count(COUNTER_BOOKS_EVICTED, count);
+        LOG(LOG_DEBUG, "Evicted %d books holding %zu bytes", count, bytes);
+    }
+    return expires;
+}
+
+// True if a retention policy no longer keeps the oldest completed book (caller holds list_mutex)
+int retention_exceeded(const Book *oldest, uint64_t now) {
+    return (max_completed_books > 0 && completed_book_count > max_completed_books) ||
+           (max_retained_bytes > 0 && retained_bytes > max_retained_bytes) ||
+           (max_book_age_ns > 0 && now - oldest->completed_ns >= max_book_age_ns);
+}
+
+// Memory a written book still holds: its text, nodes, index and mapped files
+size_t book_resident_bytes(const Book *book) {
+    size_t bytes = sizeof(Book) + book->text_cap + book->line_cap * sizeof(uint64_t) + book->index_map_len + book->text_map_len;
+    for (ArenaBlock *block = book->arena.current; block != NULL; block = block->next) {
+        bytes += sizeof(ArenaBlock) + block->size;
+    }
+    for (int p = 0; p < search_term_count; p++) {
+        bytes += book->match_caps[p] * sizeof(uint32_t);
+    }
+    return bytes;
+}
+
+// Let the reclaimer apply the retention policies to the books the writer thread just completed
+void wake_reclaimer(void) {
+    pthread_mutex_lock(&reclaim_mutex);
+    reclaim_pending = 1;
+    pthread_cond_signal(&reclaim_cond);
+    pthread_mutex_unlock(&reclaim_mutex);
+}
+
+// Evict old books off the writer thread's path: after each of its batches, and with -T
+// whenever the oldest book expires
+void *reclaimer_thread_func(void *arg) {
+    (void)arg;
+    while (1) {
+        uint64_t expires = evict_completed_books();
+
+        pthread_mutex_lock(&reclaim_mutex);
+        while (!reclaim_pending) {
+            if (expires == 0) {
+                pthread_cond_wait(&reclaim_cond, &reclaim_mutex);
+                continue;
+            }
+            struct timespec deadline = {(time_t)(expires / 1000000000), (long)(expires % 1000000000)};
+            if (pthread_cond_timedwait(&reclaim_cond, &reclaim_mutex, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+        reclaim_pending = 0;
+        pthread_mutex_unlock(&reclaim_mutex);
+    }
+    return NULL;
+}
+
+// True if book a is reported before book b: more occurrences first, then connection order
+int ranks_before(const Book *a, const Book *b) {
+    if (a->ranked_occurrences != b->ranked_occurrences) {
+        return a->ranked_occurrences > b->ranked_occurrences;
+    }
+    return a->id < b->id;
+}
+
+// Swap two heap slots and keep each book's heap_index in step (caller holds rank_mutex)
+void rank_heap_swap(int i, int j) {
+    Book *temp = rank_heap[i];
+    rank_heap[i] = rank_heap[j];
+    rank_heap[j] = temp;
+    rank_heap[i]->heap_index = i;
+    rank_heap[j]->heap_index = j;
+}
+
+// Restore the heap after a book's key grew (caller holds rank_mutex)
+void rank_heap_sift_up(int i) {
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!ranks_before(rank_heap[i], rank_heap[parent])) {
+            break;
+        }
+        rank_heap_swap(i, parent);
+        i = parent;
+    }
+}
+
+// Restore the heap after a book's key shrank or it moved down (caller holds rank_mutex)
+void rank_heap_sift_down(int i) {
+    while (1) {
+        int best = i, left = 2 * i + 1, right = 2 * i + 2;
+        if (left < rank_heap_size && ranks_before(rank_heap[left], rank_heap[best]))
+            best = left;
+        if (right < rank_heap_size && ranks_before(rank_heap[right], rank_heap[best]))
+            best = right;
+        if (best == i)
+            break;
+        rank_heap_swap(i, best);
+        i = best;
+    }
+}
+
+// Register a new book with the ranking
+void add_book_to_ranking(Book *book) {
+    pthread_mutex_lock(&rank_mutex);
+    if (rank_heap_size == rank_heap_capacity) {
+        int new_capacity = rank_heap_capacity ? rank_heap_capacity * 2 : 64;
+        Book **heap = realloc(rank_heap, new_capacity * sizeof(Book *));
+        if (heap == NULL) {
+            error("ERROR growing ranking heap");
+        }
+        rank_heap = heap;
+        rank_heap_capacity = new_capacity;
+    }
+    book->ranked_occurrences = atomic_load_explicit(&book->occurrences, memory_order_relaxed);
+    book->heap_index = rank_heap_size;
+    rank_heap[rank_heap_size++] = book;
+    rank_heap_sift_up(book->heap_index);
+    pthread_mutex_unlock(&rank_mutex);
+}
+
+// Take a book out of the ranking before it is freed
+void remove_book_from_ranking(Book *book) {
+    pthread_mutex_lock(&rank_mutex);
+    int i = book->heap_index;
+    rank_heap_size--;
+    if (i != rank_heap_size) {
+        // The last book fills the hole; it may belong above it or below it, wherever sift_up leaves it
+        Book *moved = rank_heap[rank_heap_size];
+        rank_heap_swap(i, rank_heap_size);
+        rank_heap_sift_up(i);
+        rank_heap_sift_down(moved->heap_index);
+    }
+    pthread_mutex_unlock(&rank_mutex);
+}
+
+// Publish a book's new occurrence count to the ranking; occurrences only ever grow
+void update_ranking(Book *book) {
+    int occurrences = atomic_load_explicit(&book->occurrences, memory_order_relaxed);
+    pthread_mutex_lock(&rank_mutex);
+    book->ranked_occurrences = occurrences;
+    rank_heap_sift_up(book->heap_index);
+    pthread_mutex_unlock(&rank_mutex);
+}
+
+// Copy the top books, best first, into entries; O(limit log limit) without disturbing the heap
+int collect_top_books(RankEntry *entries, int limit) {
+    int count = 0;
+
+    pthread_mutex_lock(&rank_mutex);
+    if (limit > rank_heap_size) {
+        limit = rank_heap_size;
+    }
+
+    // Frontier of heap slots whose parents were already taken, itself kept as a heap;
+    // each step takes one slot and adds at most two, so it never exceeds limit + 1
+    int *frontier = malloc((limit + 1) * sizeof(int));
+    if (frontier == NULL) {
+        error("ERROR allocating ranking frontier");
+    }
+    int frontier_size = 0;
+    if (limit > 0) {
+        frontier[frontier_size++] = 0;
+    }
+
+    while (count < limit) {
+        // Take the best frontier slot
+        int slot = frontier[0];
+        frontier[0] = frontier[--frontier_size];
+        for (int i = 0;;) {
+            int best = i, left = 2 * i + 1, right = 2 * i + 2;
+            if (left < frontier_size && ranks_before(rank_heap[frontier[left]], rank_heap[frontier[best]]))
+                best = left;
+            if (right < frontier_size && ranks_before(rank_heap[frontier[right]], rank_heap[frontier[best]]))
+                best = right;
+            if (best == i)
+                break;
+            int temp = frontier[i];
+            frontier[i] = frontier[best];
+            frontier[best] = temp;
+            i = best;
+        }
+
+        // Copy everything the report prints; the book may be evicted once rank_mutex is released
+        Book *book = rank_heap[slot];
+        entries[count].id = book->id;
+        entries[count].occurrences = book->ranked_occurrences;
+        if (entries[count].pattern_occurrences != NULL) {
+            int occurrences;
+            snapshot_occurrences(book, &occurrences, entries[count].pattern_occurrences);
+        }
+        count++;
+
+        // Its children become candidates
+        for (int child = 2 * slot + 1; child <= 2 * slot + 2 && child < rank_heap_size; child++) {
+            int i = frontier_size++;
+            frontier[i] = child;
+            while (i > 0 && ranks_before(rank_heap[frontier[i]], rank_heap[frontier[(i - 1) / 2]])) {
+                int temp = frontier[i];
+                frontier[i] = frontier[(i - 1) / 2];
+                frontier[(i - 1) / 2] = temp;
+                i = (i - 1) / 2;
+            }
+        }
+    }
+    pthread_mutex_unlock(&rank_mutex);
+
+    free(frontier);
+    return count;
+}
+
+void print_sorted_books() {
+    // Copy the top books out under rank_mutex, then print without holding any lock
+    pthread_mutex_lock(&rank_mutex);
+    int limit = report_top_k > 0 && report_top_k < rank_heap_size ? report_top_k : rank_heap_size;
+    pthread_mutex_unlock(&rank_mutex);
+
+    RankEntry *entries = malloc((limit > 0 ? limit : 1) * sizeof(RankEntry));
+    int *pattern_counts = NULL;
+    if (search_term_count > 1) {
+        pattern_counts = malloc((size_t)(limit > 0 ? limit : 1) * search_term_count * sizeof(int));
+    }
+    if (entries == NULL || (search_term_count > 1 && pattern_counts == NULL)) {
+        error("ERROR allocating ranking report");
+    }
+    for (int i = 0; i < limit; i++) {
+        entries[i].pattern_occurrences = pattern_counts != NULL ? pattern_counts + (size_t)i * search_term_count : NULL;
+    }
+    int count = collect_top_books(entries, limit);
+
+    printf("Books sorted by occurrences:\n");
+    for (int i = 0; i < count; i++) {
+        // Derive the filename from the connection order/book number
+        char filename[24];
+        sprintf(filename, "book_%02d.txt", entries[i].id);  // e.g., "book_01.txt", "book_02.txt"
+
+        // Print the book title and occurrences, as ranked
+        printf("Book Title: %s (Occurrences: %d)\n", filename, entries[i].occurrences);
+
+        // Break the total down by search term when there is more than one; the snapshot
+        // may include matches published after the book was last re-ranked
+        if (entries[i].pattern_occurrences != NULL) {
+            for (int p = 0; p < search_term_count; p++) {
+                if (entries[i].pattern_occurrences[p] > 0) {
+                    printf("    %s: %d\n", search_terms[p], entries[i].pattern_occurrences[p]);
+                }
+            }
+        }
+    }
+    free(pattern_counts);
+    free(entries);
+}
+
+
+void *analysis_thread_func(void *arg) {
+    (void)arg;
+    while (1) {
+        sleep(5);  // Wait for 5 seconds (or whatever interval is needed)
+
+        // Only the analysis thread prints the report, and the ranking has its own lock
+        print_sorted_books();             // Print the sorted results by occurrences
+    }
+    return NULL;
+}
+
+// Function to add a finished book to the global shared list (caller holds list_mutex)
+void add_node_to_global_list(Book *book) {
+    // Append the book to the global list (track all books, empty ones too, so they can be evicted)
+    book->next = NULL;
+    if (global_list_tail == NULL) {
+        global_list_head = book;
+    } else {
+        global_list_tail->next = book;
+    }
+    global_list_tail = book;
+    book->completed_ns = now_ns();
+    completed_book_count++;
+}
+
+// Free every book in the global list
+void free_global_list(Book *book) {
+    while (book != NULL) {
+        Book *next = book->next;
+        unregister_book(book);
+        remove_book_from_ranking(book);
+        release_book(book);
+        book = next;
+    }
+}
+
+// Add one search term to the list compiled at startup
+void add_search_term(const char *term) {
+    if (term[0] == '\0') {
+        fprintf(stderr, "ERROR: Search terms must not be empty\n");
+        exit(1);
+    }
+    if (strchr(term, '\n') != NULL) {
+        // Lines are matched as a stream; a term spanning a newline would span two lines
+        fprintf(stderr, "ERROR: Search terms must not contain a newline\n");
+        exit(1);
+    }
+
+    char **terms = realloc(search_terms, (search_term_count + 1) * sizeof(char *));
+    if (terms == NULL) {
+        error("ERROR allocating search terms");
+    }
+    search_terms = terms;
+    search_terms[search_term_count] = strdup(term);
+    if (search_terms[search_term_count] == NULL) {
+        error("ERROR duplicating search term");
+    }
+    search_term_count++;
+}
+
+// Read search terms from a file, one per line; blank lines are skipped
+void load_search_terms(const char *path) {
+    char line[MAX_PATTERN_LENGTH];
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        error("ERROR opening pattern file");
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';  // Strip the line ending
+        if (line[0] != '\0') {
+            add_search_term(line);
+        }
+    }
+    fclose(file);
+}
+
+// Compile the patterns into a dense Aho-Corasick DFA
+void build_automaton(Automaton *ac, char **patterns, int pattern_count) {
+    int max_states = 1;  // The root
+    for (int p = 0; p < pattern_count; p++) {
+        max_states += strlen(patterns[p]);
+    }
+
+    ac->next = malloc(max_states * sizeof(*ac->next));
+    ac->output = calloc(max_states, sizeof(int));
+    ac->output_link = calloc(max_states, sizeof(int));
+    ac->first_pattern = malloc(max_states * sizeof(int));
+    ac->pattern_next = malloc(pattern_count * sizeof(int));
+    int *fail = calloc(max_states, sizeof(int));
+    int *queue = malloc(max_states * sizeof(int));
+    if (ac->next == NULL || ac->output == NULL || ac->output_link == NULL || ac->first_pattern == NULL ||
+        ac->pattern_next == NULL || fail == NULL || queue == NULL) {
+        error("ERROR allocating automaton");
+    }
+
+    // Build the trie; -1 marks a missing edge until the failure pass fills it in
+    memset(ac->next[0], -1, sizeof(ac->next[0]));
+    ac->first_pattern[0] = -1;
+    ac->state_count = 1;
+    for (int p = 0; p < pattern_count; p++) {
+        int state = 0;
+        for (const unsigned char *c = (const unsigned char *)patterns[p]; *c != '\0'; c++) {
+            if (ac->next[state][*c] == -1) {
+                int new_state = ac->state_count++;
+                memset(ac->next[new_state], -1, sizeof(ac->next[new_state]));
+                ac->first_pattern[new_state] = -1;
+                ac->next[state][*c] = new_state;
+            }
+            state = ac->next[state][*c];
+        }
+        ac->pattern_next[p] = ac->first_pattern[state];
+        ac->first_pattern[state] = p;
+    }
+
+    // Breadth-first pass: compute failure links and turn the trie into a full DFA
+    int queue_head = 0, queue_tail = 0;
+    for (int c = 0; c < 256; c++) {
+        int child = ac->next[0][c];
+        if (child == -1) {
+            ac->next[0][c] = 0;
+        } else {
+            fail[child] = 0;
+            queue[queue_tail++] = child;
+        }
+    }
+    while (queue_head < queue_tail) {
+        int state = queue[queue_head++];
+        int suffix = fail[state];
+
+        // Link to the nearest state on the suffix chain that ends a pattern
+        ac->output_link[state] = ac->first_pattern[suffix] != -1 ? suffix : ac->output_link[suffix];
+        ac->output[state] = ac->first_pattern[state] != -1 ? state : ac->output_link[state];
+
+        for (int c = 0; c < 256; c++) {
+            int child = ac->next[state][c];
+            if (child == -1) {
+                ac->next[state][c] = ac->next[suffix][c];
+            } else {
+                fail[child] = ac->next[suffix][c];
+                queue[queue_tail++] = child;
+            }
+        }
+    }
+
+    free(fail);
+    free(queue);
+}
+
+// Count (overlapping) occurrences of every pattern in text, resuming from *state; returns the total
+int count_matches(const Automaton *ac, int *state_ptr, const char *text, size_t len, int *pattern_counts, int *line_counts) {
+    const unsigned char *pos = (const unsigned char *)text;
+    const unsigned char *end = pos + len;
+    int state = *state_ptr;
+    int total = 0;
+
+    while (pos < end) {
+        state = ac->next[state][*pos++];
+        for (int out = ac->output[state]; out != 0; out = ac->output_link[out]) {
+            for (int p = ac->first_pattern[out]; p != -1; p = ac->pattern_next[p]) {
+                pattern_counts[p]++;
+                line_counts[p]++;
+                total++;
+            }
+        }
+    }
+    *state_ptr = state;
+    return total;
+}
+
+// Portable single-term kernel: memchr for the first byte, memcmp for the rest
+size_t count_occurrences_scalar(const char *text, size_t len, const char *pattern, size_t pattern_len) {
+    const char *pos = text;
+    const char *end = text + len;
+    size_t count = 0;
+
+    while ((size_t)(end - pos) >= pattern_len &&
+           (pos = memchr(pos, pattern[0], end - pos - pattern_len + 1)) != NULL) {
+        if (memcmp(pos + 1, pattern + 1, pattern_len - 1) == 0) {
+            count++;
+        }
+        pos++;  // Overlapping matches count too
+    }
+    return count;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// SSE2 kernel: compare the first and last pattern bytes at 16 candidate positions at once,
+// then verify the middle bytes of each surviving candidate
+__attribute__((target("sse2")))
+size_t count_occurrences_sse2(const char *text, size_t len, const char *pattern, size_t pattern_len) {
+    if (pattern_len > len) {
+        return 0;
+    }
+
+    const __m128i first = _mm_set1_epi8(pattern[0]);
+    const __m128i last = _mm_set1_epi8(pattern[pattern_len - 1]);
+    size_t starts = len - pattern_len + 1;  // Number of positions a match can start at
+    size_t count = 0;
+    size_t i = 0;
+
+    if (starts < 16) {
+        return count_occurrences_scalar(text, len, pattern, pattern_len);
+    }
+
+    while (i < starts) {
+        // The final block is moved back to end at the last start; positions already counted are masked off
+        size_t block = i + 16 <= starts ? i : starts - 16;
+        __m128i block_first = _mm_loadu_si128((const __m128i *)(text + block));
+        __m128i block_last = _mm_loadu_si128((const __m128i *)(text + block + pattern_len - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, block_first),
+                                                        _mm_cmpeq_epi8(last, block_last)));
+        mask &= ~0u << (i - block);
+        i = block + 16;
+        if (pattern_len <= 2) {
+            count += __builtin_popcount(mask);  // First and last byte are the whole pattern
+            continue;
+        }
+        while (mask != 0) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(text + block + bit + 1, pattern + 1, pattern_len - 2) == 0) {
+                count++;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return count;
+}
+
+// AVX2 kernel: same filter as the SSE2 one, 32 candidate positions per step
+__attribute__((target("avx2,popcnt")))
+size_t count_occurrences_avx2(const char *text, size_t len, const char *pattern, size_t pattern_len) {
+    if (pattern_len > len) {
+        return 0;
+    }
+
+    const __m256i first = _mm256_set1_epi8(pattern[0]);
+    const __m256i last = _mm256_set1_epi8(pattern[pattern_len - 1]);
+    size_t starts = len - pattern_len + 1;
+    size_t count = 0;
+    size_t i = 0;
+
+    if (starts < 32) {
+        return count_occurrences_sse2(text, len, pattern, pattern_len);
+    }
+
+    while (i < starts) {
+        size_t block = i + 32 <= starts ? i : starts - 32;
+        __m256i block_first = _mm256_loadu_si256((const __m256i *)(text + block));
+        __m256i block_last = _mm256_loadu_si256((const __m256i *)(text + block + pattern_len - 1));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first, block_first),
+                                                                        _mm256_cmpeq_epi8(last, block_last)));
+        mask &= ~0u << (i - block);
+        i = block + 32;
+        if (pattern_len <= 2) {
+            count += __builtin_popcount(mask);
+            continue;
+        }
+        while (mask != 0) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(text + block + bit + 1, pattern + 1, pattern_len - 2) == 0) {
+                count++;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return count;
+}
+#endif
+
+// Pick the widest counting kernel this CPU supports
+count_kernel_fn select_count_kernel(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return count_occurrences_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return count_occurrences_sse2;
+    }
+#endif
+    return count_occurrences_scalar;
+}
+
+// Carve size bytes out of the arena, starting a new block when the current one is full
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + 7) & ~(size_t)7;  // Keep every allocation 8-byte aligned
+
+    ArenaBlock *block = arena->current;
+    if (block == NULL || block->size - block->used < size) {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(ArenaBlock) + block_size);
+        if (block == NULL) {
+            error("ERROR allocating arena block");
+        }
+        block->next = arena->current;
+        block->used = 0;
+        block->size = block_size;
+        arena->current = block;
+    }
+
+    void *ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+// Release every block owned by the arena
+void arena_free(Arena *arena) {
+    ArenaBlock *block = arena->current;
+    while (block != NULL) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->current = NULL;
+}
+
+// Queue a write for the writer thread
+void enqueue_write(WriteJob *job) {
+    queue_bytes(job);
+
+    // In the pipeline only the aggregators write, each through its own ring to the persist stage
+    if (pipeline_enabled) {
+        stage_send(stage_thread, 0, job);
+        return;
+    }
+    job->next = NULL;
+    pthread_mutex_lock(&write_mutex);
+    if (write_tail == NULL) {
+        write_head = job;
+    } else {
+        write_tail->next = job;
+    }
+    write_tail = job;
+    pthread_cond_signal(&write_cond);
+    pthread_mutex_unlock(&write_mutex);
+}
+
+// Queue a finished book to be written out from its node list in one go
+void enqueue_book_write(Book *book) {
+    WriteJob *job = calloc(1, sizeof(WriteJob));
+    if (job == NULL) {
+        error("ERROR allocating write job");
+    }
+    job->book = book;
+    job->whole_book = 1;
+    job->last = 1;
+    enqueue_write(job);
+}
+
+// Take batches of jobs off the queue, write them out, then let the reclaimer evict finished books
+void *writer_thread_func(void *arg) {
+    WriteJob *batch[WRITE_BATCH_MAX];
+
+    stage_thread = (StageThread *)arg;  // The persist stage of the pipeline, or NULL
+    if (stage_thread != NULL && stage_thread->cpu >= 0) {
+        pin_to_cpu(stage_thread->cpu);
+    }
+
+    while (1) {
+        int count = take_write_jobs(batch);
+        uint64_t start = metrics_start();
+        if (io_backend == IO_BACKEND_URING) {
+            write_batch_uring(batch, count);
+        } else {
+            write_batch(batch, count);
+        }
+        metrics_stop(METRIC_WRITE_BATCH, start);
+
+        // Keep memory bounded: the reclaimer drops the oldest completed books and frees them off this thread
+        wake_reclaimer();
+    }
+    return NULL;
+}
+
+// Wait for queued jobs and take up to WRITE_BATCH_MAX of them, oldest first; returns how many
+int take_write_jobs(WriteJob **batch) {
+    int count = 0;
+    if (stage_thread != NULL) {
+        batch[count++] = stage_receive(stage_thread);
+        while (count < WRITE_BATCH_MAX && (batch[count] = stage_poll(stage_thread)) != NULL) {
+            count++;
+        }
+        return count;
+    }
+
+    pthread_mutex_lock(&write_mutex);
+    while (write_head == NULL) {
+        pthread_cond_wait(&write_cond, &write_mutex);
+    }
+    while (write_head != NULL && count < WRITE_BATCH_MAX) {
+        batch[count++] = write_head;
+        write_head = write_head->next;
+    }
+    if (write_head == NULL) {
+        write_tail = NULL;
+    }
+    pthread_mutex_unlock(&write_mutex);
+    return count;
+}
+
+// Write a batch of jobs with one pwritev() per run of adjacent lines, honouring the fsync policy
+void write_batch(WriteJob **batch, int count) {
+    for (int i = 0; i < count; i++) {
+        WriteJob *job = batch[i];
+        Book *book = job->book;
+        if (book->out_fd < 0) {
+            book->out_fd = open_book_file(book);
+        }
+
+        if (job->whole_book) {
+            uint64_t start = metrics_start();
+            write_book_to_file(book, book->out_fd);
+            metrics_stop(METRIC_WRITE_BOOK, start);
+        } else {
+            struct iovec iov = {job->buffer + job->start, job->len};
+            write_all(book->out_fd, &iov, 1, job->file_offset);
+        }
+        if (job->last && fsync_policy == FSYNC_BOOK && fdatasync(book->out_fd) < 0) {
+            LOG(LOG_ERROR, "ERROR syncing file: %m");
+        }
+        if (fsync_policy != FSYNC_BATCH) {
+            complete_job(job);
+            batch[i] = NULL;
+        }
+    }
+
+    // Sync the batch's files back to back, so the device sees one burst of flushes
+    if (fsync_policy == FSYNC_BATCH) {
+        for (int i = 0; i < count; i++) {
+            if (batch[i]->last && fdatasync(batch[i]->book->out_fd) < 0) {
+                LOG(LOG_ERROR, "ERROR syncing file: %m");
+            }
+            complete_job(batch[i]);
+        }
+    }
+}
+
+// Write a batch of jobs through io_uring: the batch's opens, writes, syncs and closes each
+// go to the kernel in one submission
+void write_batch_uring(WriteJob **batch, int count) {
+    static char filenames[WRITE_BATCH_MAX][32];
+    static struct iovec iovs[WRITE_BATCH_MAX][URING_IOV_MAX];
+    int iov_counts[WRITE_BATCH_MAX];
+    Node *cursors[WRITE_BATCH_MAX];
+    int results[WRITE_BATCH_MAX];
+    struct io_uring_sqe *sqe;
+    int submitted = 0;
+
+    // Open each file the batch starts; -2 marks a book whose open is already queued
+    for (int i = 0; i < count; i++) {
+        Book *book = batch[i]->book;
+        results[i] = book->out_fd;
+        if (book->out_fd == -1) {
+            snprintf(filenames[i], sizeof(filenames[i]), "book_%02d.txt", book->id);
+            sqe = io_ring_sqe(&writer_ring);
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (unsigned long)filenames[i];
+            sqe->len = 0666;
+            sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+            sqe->user_data = i;
+            book->out_fd = -2;
+            submitted++;
+        }
+    }
+    io_ring_wait_all(&writer_ring, submitted, results);
+    for (int i = 0; i < count; i++) {
+        if (batch[i]->book->out_fd == -2) {
+            if (results[i] < 0) {
+                errno = -results[i];
+                error("ERROR opening file");
+            }
+            batch[i]->book->out_fd = results[i];
+        }
+    }
+
+    // Every write names its file offset, so writes to the same file may complete in any order
+    for (int i = 0; i < count; i++) {
+        WriteJob *job = batch[i];
+        if (job->whole_book) {
+            cursors[i] = job->book->book_head;
+            iov_counts[i] = gather_book_lines(job->book, &cursors[i], iovs[i], URING_IOV_MAX);
+        } else {
+            cursors[i] = NULL;
+            iovs[i][0].iov_base = job->buffer + job->start;
+            iovs[i][0].iov_len = job->len;
+            iov_counts[i] = 1;
+        }
+        sqe = io_ring_sqe(&writer_ring);
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = job->book->out_fd;
+        sqe->addr = (unsigned long)iovs[i];
+        sqe->len = iov_counts[i];
+        sqe->off = job->file_offset;
+        sqe->user_data = i;
+    }
+    io_ring_wait_all(&writer_ring, count, results);
+
+    // Short writes and books with more segments than one writev carries finish synchronously
+    for (int i = 0; i < count; i++) {
+        if (results[i] < 0) {
+            errno = -results[i];
+            error("ERROR writing file");
+        }
+        struct iovec *iov = iovs[i];
+        int iov_count = iov_counts[i];
+        size_t offset = batch[i]->file_offset + results[i];
+        iov_advance(&iov, &iov_count, results[i]);
+        offset += write_all(batch[i]->book->out_fd, iov, iov_count, offset);
+        while ((iov_count = gather_book_lines(batch[i]->book, &cursors[i], iovs[i], URING_IOV_MAX)) > 0) {
+            offset += write_all(batch[i]->book->out_fd, iovs[i], iov_count, offset);
+        }
+    }
+
+    // Files are synced and closed once all of the batch's writes are done
+    for (int step = 0; step < 2; step++) {
+        if (step == 0 && fsync_policy == FSYNC_NONE) {
+            continue;
+        }
+        submitted = 0;
+        for (int i = 0; i < count; i++) {
+            if (!batch[i]->last) {
+                continue;
+            }
+            sqe = io_ring_sqe(&writer_ring);
+            sqe->opcode = step == 0 ? IORING_OP_FSYNC : IORING_OP_CLOSE;
+            sqe->fd = batch[i]->book->out_fd;
+            sqe->fsync_flags = step == 0 ? IORING_FSYNC_DATASYNC : 0;
+            sqe->user_data = i;
+            submitted++;
+        }
+        io_ring_wait_all(&writer_ring, submitted, results);
+        for (int i = 0; step == 0 && i < count; i++) {
+            if (batch[i]->last && results[i] < 0) {
+                errno = -results[i];
+                LOG(LOG_ERROR, "ERROR syncing file: %m");
+            }
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (batch[i]->last) {
+            batch[i]->book->out_fd = -1;  // Already closed by the ring
+        }
+        complete_job(batch[i]);
+    }
+}
+
+// Release a written job; after a book's last job, close its file and make the book evictable
+void complete_job(WriteJob *job) {
+    Book *book = job->book;
+    metrics_count(COUNTER_BYTES_WRITTEN, job->whole_book ? book->indexed_len : job->len);
+    if (job->last) {
+        if (book->out_fd >= 0) {
+            close(book->out_fd);
+            book->out_fd = -1;
+        }
+        write_book_index(book);
+
+        metrics_count(COUNTER_BOOKS_WRITTEN, 1);
+        LOG(LOG_INFO, "Data written to file: book_%02d.txt", book->id);
+    }
+
+    // Written bytes stop counting against the budgets; after the last job nothing of the book does
+    if (budgets_enabled) {
+        release_bytes(book, job->last ? atomic_load(&book->held_bytes) : job->len,
+                      job->last ? atomic_load(&book->queued_bytes) : job->len);
+    }
+
+    // Only now may the book be evicted, so only now does it count against -M. The reclaimer may free
+    // it as soon as it is marked written, so nothing of it is touched after that
+    if (job->last) {
+        pthread_mutex_lock(&list_mutex);
+        book->retained_bytes = book_resident_bytes(book);
+        retained_bytes += book->retained_bytes;
+        pthread_mutex_unlock(&list_mutex);
+        atomic_store(&book->written, 1);
+    }
+    free(job->buffer);
+    free(job);
+}
+
+// Create (or truncate) a book's output file, named by connection order
+int open_book_file(Book *book) {
+    char filename[32];
+    snprintf(filename, sizeof(filename), "book_%02d.txt", book->id);  // Use connection order for filename
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        error("ERROR opening file");
+    }
+    return fd;
+}
+
+// Write every line of a book that is still held in memory to its output file
+void write_book_to_file(Book *book, int fd) {
+    struct iovec iov[IOV_BATCH];
+    int iov_count;
+    Node *cursor = book->book_head;
+    size_t offset = cursor != NULL ? cursor->offset : 0;
+
+    while ((iov_count = gather_book_lines(book, &cursor, iov, IOV_BATCH)) > 0) {
+        offset += write_all(fd, iov, iov_count, offset);
+    }
+}
+
+// Turn the lines from *cursor on into at most max segments, merging lines that sit back to back
+// in the text buffer; advances *cursor past them and returns the number of segments
+int gather_book_lines(Book *book, Node **cursor, struct iovec *iov, int max) {
+    int iov_count = 0;
+    Node *temp = *cursor;
+
+    for (; temp != NULL; temp = temp->book_next) {
+        char *line = book_text_at(book, temp->offset);
+        if (iov_count > 0 && (char *)iov[iov_count - 1].iov_base + iov[iov_count - 1].iov_len == line) {
+            iov[iov_count - 1].iov_len += temp->length;
+            continue;
+        }
+        if (iov_count == max) {
+            break;
+        }
+        iov[iov_count].iov_base = line;
+        iov[iov_count].iov_len = temp->length;
+        iov_count++;
+    }
+    *cursor = temp;
+    return iov_count;
+}
+
+// pwritev() every segment at offset, resuming after short writes; returns the bytes written
+size_t write_all(int fd, struct iovec *iov, int iov_count, size_t offset) {
+    size_t written = 0;
+    while (iov_count > 0) {
+        ssize_t n = pwritev(fd, iov, iov_count, offset + written);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            error("ERROR writing file");
+        }
+        iov_advance(&iov, &iov_count, n);
+        written += n;
+    }
+    return written;
+}
+
+// Drop the first n bytes from a list of segments
+void iov_advance(struct iovec **iov, int *iov_count, size_t n) {
+    while (*iov_count > 0 && n >= (*iov)->iov_len) {
+        n -= (*iov)->iov_len;
+        (*iov)++;
+        (*iov_count)--;
+    }
+    if (*iov_count > 0) {
+        (*iov)->iov_base = (char *)(*iov)->iov_base + n;
+        (*iov)->iov_len -= n;
+    }
+}
+
+// Append one complete line to the book's index
+void index_add_line(Book *book, uint64_t offset, uint64_t length) {
+    if (book->line_count == book->line_cap) {
+        size_t new_cap = book->line_cap ? book->line_cap * 2 : 1024;
+        uint64_t *offsets = realloc(book->line_offsets, new_cap * sizeof(uint64_t));
+        if (offsets == NULL) {
+            error("ERROR growing book index");
+        }
+        book->line_offsets = offsets;
+        book->line_cap = new_cap;
+    }
+    book->line_offsets[book->line_count++] = offset;
+    book->indexed_len = offset + length;
+}
+
+// Record that a search term matched the given line of the book
+void index_add_match(Book *book, int pattern, uint32_t line) {
+    if (book->match_counts[pattern] == book->match_caps[pattern]) {
+        size_t new_cap = book->match_caps[pattern] ? book->match_caps[pattern] * 2 : 256;
+        uint32_t *lines = realloc(book->match_lines[pattern], new_cap * sizeof(uint32_t));
+        if (lines == NULL) {
+            error("ERROR growing book index");
+        }
+        book->match_lines[pattern] = lines;
+        book->match_caps[pattern] = new_cap;
+    }
+    book->match_lines[pattern][book->match_counts[pattern]++] = line;
+}
+
+// Write the book's sidecar index next to its output file (writer thread). It is written under
+// a temporary name and renamed into place, so an index on disk always describes a complete file
+void write_book_index(Book *book) {
+    static const char padding[8];
+    char filename[32], temp_name[40];
+    IndexHeader header;
+    IndexPattern *patterns = calloc(search_term_count, sizeof(IndexPattern));
+    struct iovec *iov = calloc(3 + 3 * search_term_count, sizeof(struct iovec));
+    if (patterns == NULL || iov == NULL) {
+        error("ERROR allocating book index");
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.pattern_count = search_term_count;
+    header.text_len = book->indexed_len;
+    header.line_count = book->line_count;
+    header.occurrences = atomic_load(&book->occurrences);  // Final: the worker published its last batch
+
+    // Lay the sections out in file order
+    uint64_t offset = sizeof(IndexHeader) + search_term_count * sizeof(IndexPattern) + book->line_count * sizeof(uint64_t);
+    for (int p = 0; p < search_term_count; p++) {
+        patterns[p].occurrences = atomic_load(&book->pattern_occurrences[p]);
+        patterns[p].match_count = book->match_counts[p];
+        patterns[p].match_offset = offset;
+        offset += (book->match_counts[p] * sizeof(uint32_t) + 7) & ~(uint64_t)7;
+    }
+    for (int p = 0; p < search_term_count; p++) {
+        patterns[p].term_offset = offset;
+        patterns[p].term_len = strlen(search_terms[p]);
+        offset += patterns[p].term_len;
+    }
+
+    int iov_count = 0;
+    iov[iov_count++] = (struct iovec){&header, sizeof(header)};
+    iov[iov_count++] = (struct iovec){patterns, search_term_count * sizeof(IndexPattern)};
+    iov[iov_count++] = (struct iovec){book->line_offsets, book->line_count * sizeof(uint64_t)};
+    for (int p = 0; p < search_term_count; p++) {
+        size_t len = book->match_counts[p] * sizeof(uint32_t);
+        iov[iov_count++] = (struct iovec){book->match_lines[p], len};
+        iov[iov_count++] = (struct iovec){(void *)padding, ((len + 7) & ~(size_t)7) - len};
+    }
+    for (int p = 0; p < search_term_count; p++) {
+        iov[iov_count++] = (struct iovec){search_terms[p], patterns[p].term_len};
+    }
+
+    snprintf(filename, sizeof(filename), "book_%02d.idx", book->id);
+    snprintf(temp_name, sizeof(temp_name), "%s.tmp", filename);
+    int fd = open(temp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        error("ERROR opening index file");
+    }
+    // Many search terms make more segments than one pwritev() takes
+    size_t written = 0;
+    for (int first = 0; first < iov_count; first += IOV_BATCH) {
+        int batch = iov_count - first < IOV_BATCH ? iov_count - first : IOV_BATCH;
+        written += write_all(fd, iov + first, batch, written);
+    }
+    if (fsync_policy != FSYNC_NONE && fdatasync(fd) < 0) {
+        LOG(LOG_ERROR, "ERROR syncing index file: %m");
+    }
+    close(fd);
+    if (rename(temp_name, filename) < 0) {
+        error("ERROR renaming index file");
+    }
+    free(patterns);
+    free(iov);
+}
+
+// Compare ids for qsort
+int compare_ids(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+// Map the books earlier runs left in the working directory back in: each one that has a
+// complete index for the current search terms is registered, ranked and counted as completed
+// without reading its text. Returns the number of books loaded
+int load_book_store(void) {
+    DIR *dir = opendir(".");
+    if (dir == NULL) {
+        error("ERROR opening working directory");
+    }
+
+    int *ids = NULL;
+    int id_count = 0, id_cap = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        int id, end = 0;
+        if (sscanf(entry->d_name, "book_%d.idx%n", &id, &end) != 1 || entry->d_name[end] != '\0' || id < 1) {
+            continue;
+        }
+        if (id_count == id_cap) {
+            id_cap = id_cap ? id_cap * 2 : 64;
+            ids = realloc(ids, id_cap * sizeof(int));
+            if (ids == NULL) {
+                error("ERROR allocating book ids");
+            }
+        }
+        ids[id_count++] = id;
+    }
+    closedir(dir);
+
+    // Ids continue after the highest one on disk, even if that book is not loaded
+    if (id_count > 0) {
+        qsort(ids, id_count, sizeof(int), compare_ids);
+        atomic_store(&last_book_id, ids[id_count - 1]);
+    }
+
+    // Only the newest books would survive eviction, so only they are loaded
+    int first = max_completed_books > 0 && id_count > max_completed_books ? id_count - max_completed_books : 0;
+    int loaded = 0;
+    for (int i = first; i < id_count; i++) {
+        loaded += load_book(ids[i]);
+    }
+    free(ids);
+    if (id_count > 0) {
+        LOG(LOG_INFO, "Loaded %d of %d stored books", loaded, id_count);
+    }
+    return loaded;
+}
+
+// Map one stored book and its index; returns 1 if it was loaded, 0 if it was skipped
+int load_book(int id) {
+    char filename[32];
+    struct stat st;
+    IndexHeader *header;
+    IndexPattern *patterns;
+
+    snprintf(filename, sizeof(filename), "book_%02d.idx", id);
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(IndexHeader)) {
+        if (fd >= 0)
+            close(fd);
+        return 0;
+    }
+    size_t index_len = st.st_size;
+    char *index_map = mmap(NULL, index_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (index_map == MAP_FAILED) {
+        return 0;
+    }
+
+    // The index must be intact and describe the search terms this run counts
+    header = (IndexHeader *)index_map;
+    patterns = (IndexPattern *)(index_map + sizeof(IndexHeader));
+    int valid = index_is_valid(index_map, index_len);
+
+    // ... and its output file must still be the size it recorded
+    snprintf(filename, sizeof(filename), "book_%02d.txt", id);
+    fd = valid ? open(filename, O_RDONLY | O_CLOEXEC) : -1;
+    if (fd < 0 || fstat(fd, &st) < 0 || (uint64_t)st.st_size != header->text_len) {
+        if (fd >= 0)
+            close(fd);
+        LOG(LOG_WARN, "Skipping stored book %d: index does not match", id);
+        munmap(index_map, index_len);
+        return 0;
+    }
+    char *text_map = NULL;
+    if (st.st_size > 0) {
+        text_map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (text_map == MAP_FAILED) {
+        munmap(index_map, index_len);
+        return 0;
+    }
+
+    Book *book = create_book_with_id(id);
+    book->index_map = index_map;
+    book->index_map_len = index_len;
+    book->text_map = text_map;
+    book->text_map_len = st.st_size;
+    atomic_store(&book->occurrences, header->occurrences);
+    for (int p = 0; p < search_term_count; p++) {
+        atomic_store(&book->pattern_occurrences[p], patterns[p].occurrences);
+    }
+    book->line_count = header->line_count;  // Queries read the rest of the index from the mapping
+    book->indexed_len = header->text_len;
+    atomic_store(&book->written, 1);
+    update_ranking(book);
+
+    // A stored book's age for -T counts from when its file was last written
+    struct timespec wall;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    int64_t age_ns = (int64_t)(wall.tv_sec - st.st_mtim.tv_sec) * 1000000000 + (wall.tv_nsec - st.st_mtim.tv_nsec);
+    pthread_mutex_lock(&list_mutex);
+    add_node_to_global_list(book);
+    if (age_ns > 0) {
+        book->completed_ns = (uint64_t)age_ns < book->completed_ns ? book->completed_ns - age_ns : 0;
+    }
+    book->retained_bytes = book_resident_bytes(book);
+    retained_bytes += book->retained_bytes;
+    pthread_mutex_unlock(&list_mutex);
+    return 1;
+}
+
+// Check everything a query will read from a mapped sidecar index before the book is registered:
+// every section lies inside the file (sizes compared by division, so no count can overflow), line
+// offsets ascend and stay below text_len, and match-line numbers ascend and stay below line_count.
+// Whether text_len is the output file's size is left to the caller
+int index_is_valid(const char *index_map, size_t index_len) {
+    const IndexHeader *header = (const IndexHeader *)index_map;
+    const IndexPattern *patterns = (const IndexPattern *)(index_map + sizeof(IndexHeader));
+    size_t offsets_start = sizeof(IndexHeader) + search_term_count * sizeof(IndexPattern);
+
+    if (index_len < offsets_start || memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+        header->pattern_count != (uint32_t)search_term_count ||
+        header->line_count > (index_len - offsets_start) / sizeof(uint64_t)) {
+        return 0;
+    }
+    const uint64_t *offsets = (const uint64_t *)(index_map + offsets_start);
+    for (uint64_t line = 0; line < header->line_count; line++) {
+        if (offsets[line] >= header->text_len || (line > 0 && offsets[line] <= offsets[line - 1])) {
+            return 0;
+        }
+    }
+
+    for (int p = 0; p < search_term_count; p++) {
+        if (patterns[p].match_offset > index_len || patterns[p].match_offset % sizeof(uint32_t) != 0 ||
+            patterns[p].match_count > (index_len - patterns[p].match_offset) / sizeof(uint32_t) ||
+            patterns[p].term_offset > index_len || patterns[p].term_len > index_len - patterns[p].term_offset ||
+            patterns[p].term_len != strlen(search_terms[p]) ||
+            memcmp(index_map + patterns[p].term_offset, search_terms[p], patterns[p].term_len) != 0) {
+            return 0;
+        }
+        const uint32_t *lines = (const uint32_t *)(index_map + patterns[p].match_offset);
+        for (uint64_t i = 0; i < patterns[p].match_count; i++) {
+            if (lines[i] >= header->line_count || (i > 0 && lines[i] <= lines[i - 1])) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// Map an -s argument to its fsync policy, or -1 if it is not one
+int parse_fsync_policy(const char *name) {
+    if (strcmp(name, "none") == 0)
+        return FSYNC_NONE;
+    if (strcmp(name, "book") == 0)
+        return FSYNC_BOOK;
+    if (strcmp(name, "batch") == 0)
+        return FSYNC_BATCH;
+    return -1;
+}
+
+// Read the split, match and aggregate stage sizes from a -P argument; returns 1, or -1 unless it is
+// three thread counts of at least 1, separated by commas
+int parse_pipeline_sizes(const char *spec) {
+    char extra;
+    if (sscanf(spec, "%d,%d,%d%c", &stage_sizes[STAGE_SPLIT], &stage_sizes[STAGE_MATCH], &stage_sizes[STAGE_AGGREGATE], &extra) != 3 ||
+        stage_sizes[STAGE_SPLIT] < 1 || stage_sizes[STAGE_MATCH] < 1 || stage_sizes[STAGE_AGGREGATE] < 1)
+        return -1;
+    return 1;
+}
+
+// Map an -i argument to its I/O backend, or -1 if it is not one
+int parse_io_backend(const char *name) {
+    if (strcmp(name, "epoll") == 0)
+        return IO_BACKEND_EPOLL;
+    if (strcmp(name, "uring") == 0)
+        return IO_BACKEND_URING;
+    return -1;
+}
+
+// Map a -v argument to its log level, or -1 if it is not one
+int parse_log_level(const char *name) {
+    static const char *names[] = {"error", "warn", "info", "debug", "trace"};
+    for (int level = LOG_ERROR; level <= LOG_TRACE; level++) {
+        if (strcmp(name, names[level]) == 0)
+            return level;
+    }
+    return -1;
+}
+
+// Queue one message on the calling thread's ring (use LOG()). Formatting happens here, in the
+// logging thread, but nothing is shared with other threads except the flusher's tail index;
+// when the ring is full the message is counted and dropped rather than waiting
+void log_write(int level, const char *format, ...) {
+    int saved_errno = errno;  // For %m
+    LogRing *ring = log_ring != NULL ? log_ring : log_register_thread();
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == LOG_RING_RECORDS) {
+        atomic_store_explicit(&ring->dropped, atomic_load_explicit(&ring->dropped, memory_order_relaxed) + 1,
+                              memory_order_relaxed);
+        return;
+    }
+
+    LogRecord *record = &ring->records[head & (LOG_RING_RECORDS - 1)];
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    record->timestamp_ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    record->level = level;
+
+    va_list args;
+    va_start(args, format);
+    errno = saved_errno;
+    int len = vsnprintf(record->text, sizeof(record->text), format, args);
+    va_end(args);
+    record->len = len < 0 ? 0 : len < (int)sizeof(record->text) ? len : (int)sizeof(record->text) - 1;
+
+    // Publish the record to the flusher
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    errno = saved_errno;
+}
+
+// Give the calling thread its own ring; rings are only ever added, so the flusher can walk the list freely
+LogRing *log_register_thread(void) {
+    LogRing *ring = aligned_alloc(CACHE_LINE_SIZE, (sizeof(LogRing) + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1));
+    if (ring == NULL) {
+        error("ERROR allocating log ring");
+    }
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->dropped, 0);
+    ring->reported_dropped = 0;
+    ring->thread_id = atomic_fetch_add(&log_thread_count, 1) + 1;
+    ring->next = atomic_load(&log_rings);
+    while (!atomic_compare_exchange_weak(&log_rings, &ring->next, ring))
+        ;
+    log_ring = ring;
+    return ring;
+}
+
+// Write up to LOG_FLUSH_BATCH queued messages to stderr, oldest first across every thread's ring,
+// in one write(); returns the number written. Safe to call from any thread (error() does)
+int log_flush(void) {
+    static char out[64 * 1024];  // Guarded by log_flush_mutex
+    size_t out_len = 0;
+    int written = 0;
+
+    pthread_mutex_lock(&log_flush_mutex);
+    LogRing *rings = atomic_load(&log_rings);
+    while (written < LOG_FLUSH_BATCH) {
+        // Merge the rings by timestamp, one record at a time
+        LogRing *oldest = NULL;
+        LogRecord *record = NULL;
+        for (LogRing *ring = rings; ring != NULL; ring = ring->next) {
+            size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+            if (tail == atomic_load_explicit(&ring->head, memory_order_acquire)) {
+                continue;
+            }
+            LogRecord *candidate = &ring->records[tail & (LOG_RING_RECORDS - 1)];
+            if (record == NULL || candidate->timestamp_ns < record->timestamp_ns) {
+                oldest = ring;
+                record = candidate;
+            }
+        }
+        if (record == NULL) {
+            break;
+        }
+
+        if (sizeof(out) - out_len < LOG_RECORD_SIZE + 64) {
+            log_output(out, out_len);
+            out_len = 0;
+        }
+        out_len += log_format_line(out + out_len, record->timestamp_ns, record->level, oldest->thread_id,
+                                   record->text, record->len);
+        atomic_store_explicit(&oldest->tail, atomic_load_explicit(&oldest->tail, memory_order_relaxed) + 1,
+                              memory_order_release);
+        written++;
+    }
+
+    // Say how much a thread lost to a full ring
+    for (LogRing *ring = rings; ring != NULL; ring = ring->next) {
+        size_t dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+        if (dropped != ring->reported_dropped && sizeof(out) - out_len >= LOG_RECORD_SIZE + 64) {
+            char text[64];
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            int len = snprintf(text, sizeof(text), "dropped %zu log messages", dropped - ring->reported_dropped);
+            out_len += log_format_line(out + out_len, (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec, LOG_WARN,
+                                       ring->thread_id, text, len);
+            ring->reported_dropped = dropped;
+        }
+    }
+    log_output(out, out_len);
+    pthread_mutex_unlock(&log_flush_mutex);
+    return written;
+}
+
+// Format one log line (time, level, thread, text) into out, which has room for it; returns its length
+size_t log_format_line(char *out, uint64_t timestamp_ns, int level, int thread_id, const char *text, int len) {
+    static const char *names[] = {"ERROR", "WARN", "INFO", "DEBUG", "TRACE"};
+    static time_t last_seconds = -1;  // Guarded by log_flush_mutex, like the buffer lines go to
+    static char date[32];
+    static size_t date_len;
+
+    // Most lines fall in the same second as the previous one; the date is formatted once per second
+    time_t seconds = timestamp_ns / 1000000000;
+    if (seconds != last_seconds) {
+        struct tm tm;
+        localtime_r(&seconds, &tm);
+        date_len = strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &tm);
+        last_seconds = seconds;
+    }
+    memcpy(out, date, date_len);
+    size_t n = date_len;
+    if (len > 0 && text[len - 1] == '\n') {
+        len--;  // Every line gets exactly one newline
+    }
+    return n + sprintf(out + n, ".%06u %-5s [%d] %.*s\n", (unsigned)(timestamp_ns % 1000000000 / 1000),
+                       names[level], thread_id, len, text);
+}
+
+// Write formatted log lines to stderr; if that fails there is nowhere left to report it
+void log_output(const char *out, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(STDERR_FILENO, out, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        out += n;
+        len -= n;
+    }
+}
+
+// Drain the rings continuously while messages keep coming, and poll them when idle
+void *log_thread_func(void *arg) {
+    (void)arg;
+    struct timespec interval = {0, LOG_FLUSH_INTERVAL_NSEC};
+    while (1) {
+        if (log_flush() == 0) {
+            nanosleep(&interval, NULL);
+        }
+    }
+    return NULL;
+}
+
+// Monotonic time in nanoseconds, for stage latencies
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// The calling thread's metrics, registered on first use like its log ring
+ThreadMetrics *metrics_for_thread(void) {
+    if (thread_metrics != NULL) {
+        return thread_metrics;
+    }
+    ThreadMetrics *metrics = aligned_alloc(CACHE_LINE_SIZE, (sizeof(ThreadMetrics) + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1));
+    if (metrics == NULL) {
+        error("ERROR allocating metrics");
+    }
+    memset(metrics, 0, sizeof(ThreadMetrics));
+    metrics->next = atomic_load(&metrics_threads);
+    while (!atomic_compare_exchange_weak(&metrics_threads, &metrics->next, metrics))
+        ;
+    thread_metrics = metrics;
+    return metrics;
+}
+
+// Start timing a stage; 0 (nothing is timed) when metrics are off
+uint64_t metrics_start(void) {
+    return metrics_enabled ? now_ns() : 0;
+}
+
+// Record the time since start in the stage's histogram, unless start says nothing was timed
+void metrics_stop(int stage, uint64_t start) {
+    if (start == 0) {
+        return;
+    }
+    metrics_record(stage, now_ns() - start);
+}
+
+// Record one duration in the stage's histogram, if metrics are on
+void metrics_record(int stage, uint64_t elapsed) {
+    if (!metrics_enabled) {
+        return;
+    }
+    ThreadMetrics *metrics = metrics_for_thread();
+    atomic_ulong *bucket = &metrics->buckets[stage][histogram_bucket(elapsed)];
+    atomic_store_explicit(bucket, atomic_load_explicit(bucket, memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_store_explicit(&metrics->sum_ns[stage], atomic_load_explicit(&metrics->sum_ns[stage], memory_order_relaxed) + elapsed,
+                          memory_order_relaxed);
+}
+
+// Add n to one of the calling thread's counters
+void metrics_count(int counter, uint64_t n) {
+    if (!metrics_enabled) {
+        return;
+    }
+    atomic_ulong *value = &metrics_for_thread()->counters[counter];
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+// Histogram bucket of a latency: bucket 0 holds everything below 2^HISTOGRAM_MIN_EXP ns, then each
+// power of two is split into HISTOGRAM_SUB_BUCKETS equal parts; the last bucket is the overflow
+int histogram_bucket(uint64_t ns) {
+    if (ns < (1ull << HISTOGRAM_MIN_EXP)) {
+        return 0;
+    }
+    int exp = 63 - __builtin_clzll(ns);
+    if (exp >= HISTOGRAM_MAX_EXP) {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+    int sub = (ns >> (exp - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1);
+    return 1 + (exp - HISTOGRAM_MIN_EXP) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+// Upper bound in ns of every latency in a bucket other than the overflow
+uint64_t histogram_bucket_bound(int bucket) {
+    if (bucket == 0) {
+        return 1ull << HISTOGRAM_MIN_EXP;
+    }
+    int exp = HISTOGRAM_MIN_EXP + (bucket - 1) / HISTOGRAM_SUB_BUCKETS;
+    int sub = (bucket - 1) % HISTOGRAM_SUB_BUCKETS;
+    return (1ull << exp) + ((uint64_t)(sub + 1) << (exp - HISTOGRAM_SUB_BITS));
+}
+
+// Listen for metrics scrapes on the loopback interface
+int open_metrics_listener(int port) {
+    struct sockaddr_in addr;
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        error("ERROR opening metrics socket");
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        error("ERROR binding metrics socket");
+    if (listen(fd, 16) < 0)
+        error("ERROR listening on metrics socket");
+    return fd;
+}
+
+// Answer each scrape with the current metrics in the Prometheus text format, one at a time;
+// whatever the request asks for, the reply is the same
+void *metrics_thread_func(void *arg) {
+    int listen_fd = (int)(long)arg;
+    char request[1024];
+
+    while (1) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED)
+                LOG(LOG_ERROR, "ERROR accepting metrics scrape: %m");
+            continue;
+        }
+        struct timeval timeout = {QUERY_SEND_TIMEOUT, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        if (read(fd, request, sizeof(request)) < 0) {
+            close(fd);
+            continue;
+        }
+
+        size_t body_len;
+        char *body = format_metrics(&body_len);
+        char header[128];
+        int header_len = snprintf(header, sizeof(header),
+                                  "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", body_len);
+        struct iovec iov[2] = {{header, header_len}, {body, body_len}};
+        send_all(fd, iov, 2);
+        free(body);
+        close(fd);
+    }
+    return NULL;
+}
+
+// Sum every thread's metrics into the Prometheus text format; returns a malloc'd buffer
+char *format_metrics(size_t *len) {
+    static const char *stage_names[METRIC_STAGES] = {"accept", "read", "split", "match", "add_node", "splice", "write_book", "write_batch",
+                                                         "throttled"};
+    static const char *counter_names[METRIC_COUNTERS] = {"connections_accepted", "bytes_received", "lines_indexed", "matches",
+                                                         "books_written", "bytes_written", "queries_answered", "match_tasks_stolen",
+                                                         "throttles", "books_evicted"};
+    static const char *counter_help[METRIC_COUNTERS] = {"Connections accepted", "Bytes received from clients", "Lines indexed",
+                                                        "Occurrences of every search term", "Books written to disk",
+                                                        "Bytes written to book files", "Queries answered",
+                                                        "Matching tasks run by a worker other than the one that split them",
+                                                        "Times a connection stopped being read because of the byte budgets",
+                                                        "Completed books dropped from memory by the retention policies"};
+    uint64_t buckets[METRIC_STAGES][HISTOGRAM_BUCKETS] = {{0}};
+    uint64_t sums[METRIC_STAGES] = {0};
+    uint64_t counters[METRIC_COUNTERS] = {0};
+
+    for (ThreadMetrics *metrics = atomic_load(&metrics_threads); metrics != NULL; metrics = metrics->next) {
+        for (int stage = 0; stage < METRIC_STAGES; stage++) {
+            for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+                buckets[stage][b] += atomic_load_explicit(&metrics->buckets[stage][b], memory_order_relaxed);
+            }
+            sums[stage] += atomic_load_explicit(&metrics->sum_ns[stage], memory_order_relaxed);
+        }
+        for (int c = 0; c < METRIC_COUNTERS; c++) {
+            counters[c] += atomic_load_explicit(&metrics->counters[c], memory_order_relaxed);
+        }
+    }
+
+    // Each bucket line is under 128 bytes
+    size_t cap = 8192 + (size_t)(METRIC_STAGES * (HISTOGRAM_BUCKETS + 3) + 5 * (PIPELINE_STAGES + 2)) * 128;
+    char *out = malloc(cap);
+    if (out == NULL) {
+        error("ERROR allocating metrics reply");
+    }
+    size_t n = 0;
+    for (int c = 0; c < METRIC_COUNTERS; c++) {
+        n += snprintf(out + n, cap - n, "# HELP server5_%s_total %s.\n# TYPE server5_%s_total counter\nserver5_%s_total %llu\n",
+                      counter_names[c], counter_help[c], counter_names[c], counter_names[c], (unsigned long long)counters[c]);
+    }
+
+    pthread_mutex_lock(&list_mutex);
+    int completed = completed_book_count;
+    size_t retained = retained_bytes;
+    pthread_mutex_unlock(&list_mutex);
+    pthread_mutex_lock(&rank_mutex);
+    int ranked = rank_heap_size;
+    pthread_mutex_unlock(&rank_mutex);
+    n += snprintf(out + n, cap - n, "# HELP server5_books_completed Completed books held in memory.\n# TYPE server5_books_completed gauge\n"
+                  "server5_books_completed %d\n", completed);
+    n += snprintf(out + n, cap - n, "# HELP server5_books_retained_bytes Memory held by the completed books on disk, counted against -M.\n"
+                  "# TYPE server5_books_retained_bytes gauge\nserver5_books_retained_bytes %zu\n", retained);
+    n += snprintf(out + n, cap - n, "# HELP server5_books_ranked Books in the ranking, uploads in progress included.\n"
+                  "# TYPE server5_books_ranked gauge\nserver5_books_ranked %d\n", ranked);
+
+    // How close the uploads are to the byte budgets, and how many are waiting on the writer thread
+    if (budgets_enabled) {
+        pthread_mutex_lock(&throttle_mutex);
+        int throttled = throttled_count;
+        pthread_mutex_unlock(&throttle_mutex);
+        n += snprintf(out + n, cap - n, "# HELP server5_budget_held_bytes Bytes received and not yet written, counted against the budgets.\n"
+                      "# TYPE server5_budget_held_bytes gauge\nserver5_budget_held_bytes %zu\n", atomic_load(&total_held_bytes));
+        n += snprintf(out + n, cap - n, "# HELP server5_budget_queued_bytes Bytes of those handed to the writer thread.\n"
+                      "# TYPE server5_budget_queued_bytes gauge\nserver5_budget_queued_bytes %zu\n", atomic_load(&total_queued_bytes));
+        n += snprintf(out + n, cap - n, "# HELP server5_connections_throttled Connections not being read until bytes are written.\n"
+                      "# TYPE server5_connections_throttled gauge\nserver5_connections_throttled %d\n", throttled);
+    }
+
+    // Where the pipeline's time goes: the bottleneck is the stage that is seldom idle while the one
+    // before it is blocked on its rings
+    if (pipeline_enabled) {
+        static const char *stage_labels[PIPELINE_STAGES] = {"receive", "split", "match", "aggregate", "persist"};
+        static const char *pipeline_names[5] = {"threads", "queue_depth", "batches_total", "idle_seconds_total", "blocked_seconds_total"};
+        static const char *pipeline_types[5] = {"gauge", "gauge", "counter", "counter", "counter"};
+        static const char *pipeline_help[5] = {"Threads in each pipeline stage", "Batches waiting in each stage's input rings",
+                                               "Batches each stage took in (receive: sent on; persist: write jobs)",
+                                               "Time each stage spent waiting for input",
+                                               "Time each stage spent waiting for room in the next stage's rings"};
+        double values[5][PIPELINE_STAGES] = {{0}};
+        for (int stage = 0; stage < PIPELINE_STAGES; stage++) {
+            values[0][stage] = stage_sizes[stage];
+            for (int i = 0; i < stage_sizes[stage]; i++) {
+                StageThread *thread = &stage_threads[stage][i];
+                for (int r = 0; r < thread->input_count; r++) {
+                    values[1][stage] += atomic_load_explicit(&thread->inputs[r]->head, memory_order_relaxed) -
+                                        atomic_load_explicit(&thread->inputs[r]->tail, memory_order_relaxed);
+                }
+                values[2][stage] += atomic_load_explicit(&thread->batches, memory_order_relaxed);
+                values[3][stage] += atomic_load_explicit(&thread->idle_ns, memory_order_relaxed) / 1e9;
+                values[4][stage] += atomic_load_explicit(&thread->blocked_ns, memory_order_relaxed) / 1e9;
+            }
+        }
+        for (int m = 0; m < 5; m++) {
+            n += snprintf(out + n, cap - n, "# HELP server5_pipeline_%s %s.\n# TYPE server5_pipeline_%s %s\n",
+                          pipeline_names[m], pipeline_help[m], pipeline_names[m], pipeline_types[m]);
+            for (int stage = 0; stage < PIPELINE_STAGES; stage++) {
+                n += snprintf(out + n, cap - n, "server5_pipeline_%s{stage=\"%s\"} %.9g\n", pipeline_names[m], stage_labels[stage],
+                              values[m][stage]);
+            }
+        }
+    }
+
+    // Per-line stages only hold the sampled calls; their _count is a fraction of the lines
+    n += snprintf(out + n, cap - n, "# HELP server5_stage_duration_seconds Time spent in each ingestion stage "
+                  "(match and add_node sample one line in %d; throttled is one connection's whole upload).\n# TYPE server5_stage_duration_seconds histogram\n", METRICS_SAMPLE_EVERY);
+    for (int stage = 0; stage < METRIC_STAGES; stage++) {
+        uint64_t cumulative = 0;
+        for (int b = 0; b < HISTOGRAM_BUCKETS - 1; b++) {
+            cumulative += buckets[stage][b];
+            n += snprintf(out + n, cap - n, "server5_stage_duration_seconds_bucket{stage=\"%s\",le=\"%.9g\"} %llu\n",
+                          stage_names[stage], histogram_bucket_bound(b) / 1e9, (unsigned long long)cumulative);
+        }
+        cumulative += buckets[stage][HISTOGRAM_BUCKETS - 1];
+        n += snprintf(out + n, cap - n, "server5_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n"
+                      "server5_stage_duration_seconds_sum{stage=\"%s\"} %.9f\n"
+                      "server5_stage_duration_seconds_count{stage=\"%s\"} %llu\n",
+                      stage_names[stage], (unsigned long long)cumulative, stage_names[stage], sums[stage] / 1e9,
+                      stage_names[stage], (unsigned long long)cumulative);
+    }
+    *len = n;
+    return out;
+}
+
+// Create a ring and map its queues; returns -1 with errno set if the kernel refuses
+int io_ring_init(IoRing *ring, unsigned entries, unsigned flags) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = flags;
+
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) {
+        return -1;
+    }
+
+    // Older kernels map the submission and completion rings separately
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+    }
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    char *cq = sq;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    }
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (cq == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    ring->fd = fd;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->to_submit = 0;
+    ring->features = params.features;
+
+    // Slot i of the submission ring always names entry i
+    unsigned *array = (unsigned *)(sq + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) {
+        array[i] = i;
+    }
+    return 0;
+}
+
+// Claim a cleared submission entry, submitting what is queued if the ring is full
+struct io_uring_sqe *io_ring_sqe(IoRing *ring) {
+    unsigned tail = *ring->sq_tail;
+    while (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+        io_ring_enter(ring, 0);
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    return sqe;
+}
+
+// Submit the queued entries and wait for at least wait_nr completions, in one system call
+int io_ring_enter(IoRing *ring, unsigned wait_nr) {
+    while (1) {
+        int ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait_nr,
+                          wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret >= 0) {
+            ring->to_submit -= ret;
+            return ret;
+        }
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            error("ERROR on io_uring_enter");
+        }
+    }
+}
+
+// Like io_ring_enter, but give up waiting after timeout_ns; returns -1 if it timed out
+int io_ring_enter_timeout(IoRing *ring, unsigned wait_nr, long timeout_ns) {
+    struct __kernel_timespec ts = {timeout_ns / 1000000000, timeout_ns % 1000000000};
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (unsigned long)&ts;
+
+    while (1) {
+        int ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait_nr,
+                          IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+        if (ret >= 0) {
+            ring->to_submit -= ret;
+            return ret;
+        }
+        if (errno == ETIME) {
+            return -1;  // Only reported when nothing was submitted, so to_submit is still right
+        }
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            error("ERROR on io_uring_enter");
+        }
+    }
+}
+
+// Next completion, or NULL if there is none yet
+struct io_uring_cqe *io_ring_cqe(IoRing *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+// Give the completion returned by io_ring_cqe back to the kernel
+void io_ring_cqe_seen(IoRing *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// Submit the queued entries and collect count completions, storing each result at index user_data
+int io_ring_wait_all(IoRing *ring, int count, int *results) {
+    int done = 0;
+    while (done < count) {
+        io_ring_enter(ring, 1);
+        struct io_uring_cqe *cqe;
+        while ((cqe = io_ring_cqe(ring)) != NULL) {
+            results[cqe->user_data] = cqe->res;
+            io_ring_cqe_seen(ring);
+            done++;
+        }
+    }
+    return done;
+}
+
+// Set up both rings and the provided-buffer ring; returns -1 with errno set if the kernel lacks
+// anything the backend uses, in which case the server keeps using epoll
+int init_io_uring(void) {
+    // Single-issuer rings and multishot receives need Linux 6.0; the flag doubles as the version check
+    if (io_ring_init(&reactor_ring, URING_ENTRIES, IORING_SETUP_SINGLE_ISSUER) < 0) {
+        return -1;
+    }
+    if (io_ring_init(&writer_ring, URING_ENTRIES, 0) < 0) {
+        return -1;
+    }
+
+    // Every opcode the backend submits must be supported
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_size);
+    if (probe == NULL) {
+        error("ERROR allocating io_uring probe");
+    }
+    if (syscall(__NR_io_uring_register, reactor_ring.fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+        free(probe);
+        return -1;
+    }
+    if (!(reactor_ring.features & IORING_FEAT_EXT_ARG)) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    int ops[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_TIMEOUT, IORING_OP_ASYNC_CANCEL,
+                 IORING_OP_OPENAT, IORING_OP_WRITEV, IORING_OP_FSYNC, IORING_OP_CLOSE};
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+            free(probe);
+            errno = EOPNOTSUPP;
+            return -1;
+        }
+    }
+    free(probe);
+
+    // Register the receive buffers once; the kernel picks one for each chunk it receives
+    recv_ring = mmap(NULL, RECV_BUFFER_COUNT * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    recv_buffers = malloc((size_t)RECV_BUFFER_COUNT * RECV_BUFFER_SIZE);
+    if (recv_ring == MAP_FAILED || recv_buffers == NULL) {
+        error("ERROR allocating receive buffers");
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)recv_ring;
+    reg.ring_entries = RECV_BUFFER_COUNT;
+    reg.bgid = RECV_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, reactor_ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return -1;
+    }
+    recv_ring->tail = 0;
+    atomic_init(&recv_buffers_free, 0);
+    for (int bid = 0; bid < RECV_BUFFER_COUNT; bid++) {
+        recycle_recv_buffer(bid);
+    }
+    return 0;
+}
+
+// Reactor for the io_uring backend: one io_uring_enter() submits new receives and reaps every
+// completion that is ready; received buffers go to the connection's inbox and the worker pool
+void uring_reactor(int sockfd) {
+    Connection *starved = NULL;  // Receives that stopped because every buffer was in use
+    Connection *stopped = NULL;  // Receives that ended while their connections were paused
+    int timeout_armed = 0;
+    int busy = 0;                // The last wait returned completions
+    struct __kernel_timespec retry = {0, 1000000};  // Wait 1 ms for workers to return buffers
+    int accepts_armed = 0;       // Accepts in flight; each may add a connection, so with the open ones they stay within the limit
+    int accept_stopped = 0;      // Out of descriptors: none are armed until fewer than accept_resume_below connections are open
+    int accept_resume_below = 0;
+    int at_limit = 0;            // No accept could be armed for the connection limit last time
+
+    while (1) {
+        int open = atomic_load(&open_connections);
+        if (accept_stopped && open < accept_resume_below) {
+            LOG(LOG_DEBUG, "Accepting connections again");
+            accept_stopped = 0;
+        }
+        while (!accept_stopped && accepts_armed < URING_ACCEPT_DEPTH && accepts_armed < connection_limit - open) {
+            uring_arm_accept(sockfd);
+            accepts_armed++;
+        }
+        if (accepts_armed == 0 && !accept_stopped && !at_limit) {
+            LOG(LOG_INFO, "%d connections open, not accepting more until one closes", connection_limit);
+        }
+        at_limit = accepts_armed == 0 && !accept_stopped;
+
+        // While data is streaming in, gather a batch of completions per system call;
+        // once a wait comes back empty, block until the next one
+        if (busy) {
+            io_ring_enter_timeout(&reactor_ring, URING_WAIT_BATCH, URING_WAIT_NSEC);
+        } else {
+            io_ring_enter(&reactor_ring, 1);
+        }
+
+        struct io_uring_cqe *cqe;
+        busy = 0;
+        while ((cqe = io_ring_cqe(&reactor_ring)) != NULL) {
+            busy = 1;
+            __u64 tag = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            io_ring_cqe_seen(&reactor_ring);
+
+            if (tag == URING_ACCEPT_TAG) {
+                accepts_armed--;
+                if (res >= 0) {
+                    uint64_t start = metrics_start();  // The kernel accepted it; this is the setup that follows
+                    uring_arm_recv(create_connection(res, &reactors[0]));
+                    metrics_stop(METRIC_ACCEPT, start);
+                    metrics_count(COUNTER_ACCEPTED, 1);
+                } else if (res == -EMFILE || res == -ENFILE || res == -ENOBUFS || res == -ENOMEM) {
+                    // Wait for a release; with no connection to release, retry after the retry timeout
+                    if (!accept_stopped) {
+                        errno = -res;
+                        LOG(LOG_WARN, "ERROR on accept, not accepting more until a connection closes: %m");
+                    }
+                    accept_stopped = 1;
+                    accept_resume_below = atomic_load(&open_connections);
+                } else if (res != -EINTR && res != -ECONNABORTED) {
+                    errno = -res;
+                    LOG(LOG_ERROR, "ERROR on accept: %m");
+                }
+            } else if (tag == URING_TIMEOUT_TAG) {
+                timeout_armed = 0;
+                if (accept_stopped && atomic_load(&open_connections) == 0) {
+                    accept_stopped = 0;  // Out of descriptors with no connection open: try again
+                }
+            } else if (tag != URING_CANCEL_TAG) {
+                deliver_received((Connection *)(unsigned long)tag, res, flags, &starved, &stopped);
+            }
+        }
+
+        // Restart starved receives once buffers are back, and stopped ones once their connections
+        // are resumed, or check again shortly (as for a stopped accept)
+        if (starved != NULL && atomic_load(&recv_buffers_free) > 0) {
+            while (starved != NULL) {
+                Connection *conn = starved;
+                starved = conn->next_starved;
+                uring_arm_recv(conn);
+            }
+        }
+        for (Connection **link = &stopped; *link != NULL;) {
+            Connection *conn = *link;
+            if (receive_paused(conn)) {
+                link = &conn->next_starved;
+            } else {
+                *link = conn->next_starved;
+                uring_arm_recv(conn);
+            }
+        }
+        if ((starved != NULL || stopped != NULL || accept_stopped || at_limit) && !timeout_armed) {
+            struct io_uring_sqe *sqe = io_ring_sqe(&reactor_ring);
+            sqe->opcode = IORING_OP_TIMEOUT;
+            sqe->addr = (unsigned long)&retry;
+            sqe->len = 1;
+            sqe->user_data = URING_TIMEOUT_TAG;
+            timeout_armed = 1;
+        }
+    }
+}
+
+// Accept one connection. A multishot accept would take in the whole backlog at once, past the
+// connection limit, so the reactor keeps a bounded number of these in flight instead
+void uring_arm_accept(int sockfd) {
+    struct io_uring_sqe *sqe = io_ring_sqe(&reactor_ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = sockfd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = URING_ACCEPT_TAG;
+}
+
+// Receive into provided buffers until the stream ends or the buffers run out
+void uring_arm_recv(Connection *conn) {
+    struct io_uring_sqe *sqe = io_ring_sqe(&reactor_ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->sockfd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RECV_BUFFER_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = (unsigned long)conn;
+}
+
+// Queue one receive completion on its connection and schedule the connection if it is idle. A paused
+// connection's bytes are spilled instead, and its receive is cancelled and left stopped until it resumes
+void deliver_received(Connection *conn, int res, unsigned flags, Connection **starved, Connection **stopped) {
+    if (!(flags & IORING_CQE_F_MORE)) {
+        conn->recv_cancelling = 0;  // The receive ended; a cancel still on its way finds nothing
+    }
+    if (res == -ENOBUFS || res == -ECANCELED) {
+        if (receive_paused(conn)) {
+            conn->next_starved = *stopped;
+            *stopped = conn;
+        } else if (res == -ENOBUFS) {
+            conn->next_starved = *starved;
+            *starved = conn;
+        } else {
+            uring_arm_recv(conn);  // Resumed before the cancel landed
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&conn->inbox_lock);
+    int paused = conn->recv_paused;
+    if (res > 0 && paused) {
+        spill_received(conn, flags >> IORING_CQE_BUFFER_SHIFT, res);
+    } else if (res > 0) {
+        int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        atomic_fetch_sub(&recv_buffers_free, 1);
+        recv_chunks[bid].len = res;
+        recv_chunks[bid].next = -1;
+        if (conn->inbox_tail >= 0) {
+            recv_chunks[conn->inbox_tail].next = bid;
+        } else {
+            conn->inbox_head = bid;
+        }
+        conn->inbox_tail = bid;
+    } else {
+        if (res < 0) {
+            errno = -res;
+            LOG(LOG_ERROR, "ERROR reading from socket: %m");
+        }
+        conn->inbox_closed = 1;  // Connection closed or error; no more completions will come
+    }
+    int idle = !conn->scheduled;
+    conn->scheduled = 1;
+    pthread_mutex_unlock(&conn->inbox_lock);
+
+    // The kernel may end a multishot receive early; keep the stream going unless it is paused
+    if (res > 0 && !(flags & IORING_CQE_F_MORE)) {
+        if (paused) {
+            conn->next_starved = *stopped;
+            *stopped = conn;
+        } else {
+            uring_arm_recv(conn);
+        }
+    } else if (res > 0 && paused && !conn->recv_cancelling) {
+        struct io_uring_sqe *sqe = io_ring_sqe(&reactor_ring);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (unsigned long)conn;
+        sqe->user_data = URING_CANCEL_TAG;
+        conn->recv_cancelling = 1;
+    }
+    if (idle) {
+        schedule_connection(conn);
+    }
+}
+
+// Copy a paused connection's received bytes aside and hand the buffer straight back (inbox_lock held)
+void spill_received(Connection *conn, int bid, size_t len) {
+    atomic_fetch_sub(&recv_buffers_free, 1);
+    if (conn->spill_len + len > conn->spill_cap) {
+        size_t cap = conn->spill_cap > 0 ? conn->spill_cap * 2 : RECV_BUFFER_SIZE;
+        while (cap < conn->spill_len + len) {
+            cap *= 2;
+        }
+        conn->spill = realloc(conn->spill, cap);
+        if (conn->spill == NULL) {
+            error("ERROR allocating spill buffer");
+        }
+        conn->spill_cap = cap;
+    }
+    memcpy(conn->spill + conn->spill_len, recv_buffers + (size_t)bid * RECV_BUFFER_SIZE, len);
+    conn->spill_len += len;
+    recycle_recv_buffer(bid);
+}
+
+// Whether a worker has paused a connection's receive over a byte budget
+int receive_paused(Connection *conn) {
+    pthread_mutex_lock(&conn->inbox_lock);
+    int paused = conn->recv_paused;
+    pthread_mutex_unlock(&conn->inbox_lock);
+    return paused;
+}
+
+// Hand a drained receive buffer back to the kernel. It is counted free first: the reactor's count
+// of it taken, when the kernel fills it again, then orders every read of its chunk here before the
+// reactor rewrites it, an order that the kernel guarantees and ThreadSanitizer could not see
+void recycle_recv_buffer(int bid) {
+    atomic_fetch_add(&recv_buffers_free, 1);
+    pthread_mutex_lock(&recv_ring_mutex);
+    unsigned short tail = recv_ring->tail;
+    struct io_uring_buf *buf = &recv_ring->bufs[tail & (RECV_BUFFER_COUNT - 1)];
+    buf->addr = (unsigned long)(recv_buffers + (size_t)bid * RECV_BUFFER_SIZE);
+    buf->len = RECV_BUFFER_SIZE;
+    buf->bid = bid;
+    __atomic_store_n(&recv_ring->tail, tail + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&recv_ring_mutex);
+}
+
+// Function to handle errors
+void error(const char *msg) {
+    int saved_errno = errno;
+    while (log_flush() > 0)
+        ;  // Messages that led up to the error come first
+    errno = saved_errno;
+    perror(msg);
+    exit(1);
+}
+
+// Length of the BOM (Byte Order Mark) at the start of UTF-8 text, or 0 if there is none
+size_t bom_length(const char *buffer, size_t len) {
+    unsigned char bom[] = {0xEF, 0xBB, 0xBF};  // UTF-8 BOM
+    if (len >= 3 && memcmp(buffer, bom, 3) == 0) {
+        return 3;
+    }
+    return 0;
 }
@@ -0,0 +1,131 @@
+#!/bin/bash
+
+# ThreadSanitizer stress test for server5: a thousand concurrent uploads while queries and the
+# analysis thread read the books' occurrence counters
+# Usage: ./tsan_stress.sh [-c connections] [-n uploads] [-r KB/s] [mode...]
+# Modes: epoll uring pipeline (default: all of them)
+# SERVER5_ARGS adds server options, e.g. SERVER5_ARGS="-m 50" to evict books during the run too.
+# Exits non-zero if ThreadSanitizer reported anything; the reports are kept in tsan_build/<mode>.log.
+
+CONNECTIONS=1000           # Concurrent connections, each a thread in the load generator
+UPLOADS=3000               # Uploads in the run
+RATE=16                    # KB/s per connection, so every connection stays open for a while at once
+BASE_PORT=24600            # Each server listens on a fresh port, from a run-specific offset above this
+SEARCH_TERM="the"
+SERVER5_ARGS=${SERVER5_ARGS:-}
+FILES="fox.txt thegoldgenrule.txt a_chars.txt b_chars.txt c_chars.txt d_chars.txt e_chars.txt f_chars.txt g_chars.txt h_chars.txt i_chars.txt j_chars.txt"
+
+ALL_MODES=(epoll uring pipeline)
+
+REPO=$(cd "$(dirname "$0")" && pwd)
+BUILD="$REPO/tsan_build"
+port=$((BASE_PORT + $$ % 400 * 5))  # Ports a recent run left in TIME_WAIT are unlikely to come up again
+failures=0
+
+# Compile the server with ThreadSanitizer, and the load generator without it
+build() {
+  mkdir -p "$BUILD" || exit 1
+  gcc -O1 -g -fsanitize=thread -pthread "$REPO/server5.c" -o "$BUILD/server5" || exit 1
+  gcc -O2 -pthread "$REPO/loadgen.c" -o "$BUILD/loadgen" || exit 1
+}
+
+# Wait until the server listens on the port, without connecting to it (a connection would be a book)
+wait_for_listen() {
+  local hex
+  hex=$(printf ':%04X ' "$1")
+  for _ in $(seq 200); do
+    grep -q "$hex[0-9A-F:]* 0A " /proc/net/tcp && return 0
+    kill -0 "$pid" 2> /dev/null || return 1
+    sleep 0.05
+  done
+  return 1
+}
+
+# Ask for the ranking and for one book's matching lines, over and over, until the load generator
+# exits; prints how many queries were answered
+query_loop() {
+  local id=1 answered=0
+  while kill -0 "$1" 2> /dev/null; do
+    timeout 10 bash -c "exec 3<> /dev/tcp/127.0.0.1/$port && printf '\\0QUERY\\nrank\\n' >&3 && cat <&3" 2> /dev/null | grep -q . &&
+      answered=$((answered + 1))
+    timeout 10 bash -c "exec 3<> /dev/tcp/127.0.0.1/$port && printf '\\0QUERY\\nbook $id\\n' >&3 && cat <&3" 2> /dev/null | grep -q . &&
+      answered=$((answered + 1))
+    id=$((id % UPLOADS + 1))
+  done
+  echo "$answered"
+}
+
+# Run the server in one mode under the load and count what ThreadSanitizer reported
+run_mode() {
+  local mode=$1 args dir out loadgen queries books warnings
+  case $mode in
+    epoll) args=() ;;
+    uring) args=(-i uring) ;;
+    pipeline) args=(-P 1,2,1) ;;
+    *) echo "Unknown mode: $mode" >&2; exit 1 ;;
+  esac
+  dir=$(mktemp -d "$WORK/$mode.XXXXXX")
+  port=$((port + 1))
+
+  # The analysis thread prints its report every 5 seconds, so the run spans several of them
+  (cd "$dir" && TSAN_OPTIONS="halt_on_error=0" exec "$BUILD/server5" -l "$port" -p "$SEARCH_TERM" -v warn \
+     "${args[@]}" $SERVER5_ARGS > server.out 2> server.err) &
+  pid=$!
+  if ! wait_for_listen "$port"; then
+    echo "FAIL $mode: server did not start"
+    failures=$((failures + 1))
+    return
+  fi
+
+  (cd "$REPO" && exec "$BUILD/loadgen" -l "$port" -c "$CONNECTIONS" -n "$UPLOADS" -r "$RATE" $FILES > "$dir/loadgen.out" 2>&1) &
+  loadgen=$!
+  query_loop "$loadgen" > "$dir/queries.out" &
+  queries=$!
+  wait "$loadgen"
+  wait "$queries"
+  sleep 6  # One more report from the analysis thread, over every finished book
+  kill "$pid" 2> /dev/null
+  wait "$pid" 2> /dev/null
+
+  books=$(find "$dir" -name 'book_*.txt' | wc -l)
+  out="$(grep '^uploads:' "$dir/loadgen.out"), $books books written, $(cat "$dir/queries.out") queries answered"
+  warnings=$(grep -c "WARNING: ThreadSanitizer" "$dir/server.err")
+  if [ "$warnings" -gt 0 ]; then
+    cp "$dir/server.err" "$BUILD/$mode.log"
+    echo "FAIL $mode: $warnings ThreadSanitizer report(s) in $BUILD/$mode.log ($out)"
+    failures=$((failures + 1))
+  elif [[ $out != *" 0 failed"* ]] || [ "$books" -ne "$UPLOADS" ]; then
+    echo "FAIL $mode: $out"
+    failures=$((failures + 1))
+  else
+    echo "PASS $mode: no ThreadSanitizer reports ($out)"
+  fi
+}
+
+while getopts "c:n:r:" opt; do
+  case $opt in
+    c) CONNECTIONS=$OPTARG ;;
+    n) UPLOADS=$OPTARG ;;
+    r) RATE=$OPTARG ;;
+    *) sed -n '5,6p' "$0" | sed 's/^# //' >&2; exit 1 ;;
+  esac
+done
+shift $((OPTIND - 1))
+modes=("${@:-${ALL_MODES[@]}}")
+
+# Every connection is a socket on both ends, plus the server's own files. The server would keep
+# its connections under a lower limit too (check.sh fd_limit), but then fewer of them overlap
+ulimit -n $((CONNECTIONS * 2 + 256)) 2> /dev/null || ulimit -n "$(ulimit -Hn)"
+
+build
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+for mode in "${modes[@]}"; do
+  run_mode "$mode"
+done
+
+if [ $failures -eq 0 ]; then
+  echo "No ThreadSanitizer reports"
+fi
+exit $((failures > 0))